@@ -1,12 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <assert.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <time.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define LJIT
+#endif
 
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #include "mpc/mpc.h"
 
+#ifndef MYLISP_HOME
+#define MYLISP_HOME "."
+#endif
+
 #define LASSERT(args, cond, fmt, ...) \
     do { \
         if (!(cond)) { \
@@ -30,13 +46,27 @@ mpc_parser_t *Comment;
 mpc_parser_t *Symbol; 
 mpc_parser_t *Sexpr;
 mpc_parser_t *Qexpr;
+mpc_parser_t *Quasi;
+mpc_parser_t *Unquote;
 mpc_parser_t *Expr; 
 mpc_parser_t *Lispy;
 
 struct lval;
 struct lenv;
+struct lmodule;
+struct lcode;
+struct lmemo;
+struct lseq;
+struct lgen;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lmodule lmodule;
+typedef struct lcode lcode;
+typedef struct lmemo lmemo;
+typedef struct lseq lseq;
+typedef struct lgen lgen;
+typedef struct lbox lbox;
+typedef struct lvnode lvnode;
 
 typedef enum lval_type {
     LVAL_NUM,
@@ -46,6 +76,9 @@ typedef enum lval_type {
     LVAL_SEXPR,
     LVAL_QEXPR,
     LVAL_FUN,
+    LVAL_SEQ,
+    LVAL_BOX,
+    LVAL_VEC,
 } lval_type;
 
 typedef lval* lbuiltin(lenv*, lval*);
@@ -58,20 +91,294 @@ typedef struct lval {
     char *str;
     lbuiltin *builtin;
     lenv *env;
+    lenv *ns;
     lval *formals;
     lval *body;
+    lcode *code;
+    lmemo *memo;
+    int macro;
+    lseq *seq;
+    lbox *box;
+    lvnode *vec;
     int count;
     struct lval **cell;
 } lval;
 
+/* A box is shared by every copy of the value holding it, so a value set
+   into it is seen through all of them. Boxes are only reference counted:
+   a box that holds itself, directly or inside a list, function or other
+   box, is never freed. set-box! does not look for such cycles, since that
+   would make it walk every value it stores. */
+struct lbox {
+    int refs;
+    lval *value;
+};
+
+/* Vectors are relaxed radix balanced trees. A leaf holds up to LVEC_M
+   values and a branch up to LVEC_M subtrees one level lower, with their
+   cumulative lengths in sizes. Nodes never change once built and are
+   shared by reference count, so slicing, updating or joining vectors
+   copies only the nodes along the paths it cuts. The empty vector has no
+   root. */
+#define LVEC_BITS 5
+#define LVEC_M (1 << LVEC_BITS)
+/* A joined branch may keep this many more subtrees than the fewest that
+   could hold its slots, which bounds the search in lvnode_find */
+#define LVEC_EXTRAS 2
+
+struct lvnode {
+    int refs;
+    int height;
+    int count;
+    long *sizes;
+    union {
+        lval *val;
+        lvnode *kid;
+    } slot[LVEC_M];
+};
+
 struct lenv {
     lenv *par;
+    lenv *ns;
+    lmodule *module;
+    int loop;
     int count;
     char **syms;
     lval **vals;
 };
 
+struct lmodule {
+    char *name;
+    lenv *env;
+    int ready;
+    int count;
+    char **syms;
+    int *slots;
+};
+
+lmodule **modules = NULL;
+int modules_count = 0;
+
+/* Symbol names are interned, so envs compare them by pointer. shadows
+   counts the bindings of a name outside the global env; while it is zero
+   every lookup of the name ends in the global env. */
+typedef struct lsym {
+    int shadows;
+    char name[];
+} lsym;
+
+lsym **lsyms = NULL;
+int lsyms_size = 0;
+int lsyms_count = 0;
+
+lenv *lroot = NULL;
+
+unsigned long lsym_hash(char *s) {
+    unsigned long h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+char *lsym_intern(char *s) {
+    if (lsyms_count * 2 >= lsyms_size) {
+        int size = lsyms_size ? lsyms_size * 2 : 256;
+        lsym **table = calloc(size, sizeof(lsym*));
+        for (int i = 0; i < lsyms_size; ++i) {
+            if (!lsyms[i]) continue;
+            unsigned long j = lsym_hash(lsyms[i]->name) & (size - 1);
+            while (table[j]) j = (j + 1) & (size - 1);
+            table[j] = lsyms[i];
+        }
+        free(lsyms);
+        lsyms = table;
+        lsyms_size = size;
+    }
+
+    unsigned long i = lsym_hash(s) & (lsyms_size - 1);
+    while (lsyms[i]) {
+        if (strcmp(lsyms[i]->name, s) == 0) return lsyms[i]->name;
+        i = (i + 1) & (lsyms_size - 1);
+    }
+
+    lsym *y = malloc(sizeof(lsym) + strlen(s) + 1);
+    y->shadows = 0;
+    strcpy(y->name, s);
+    lsyms[i] = y;
+    lsyms_count++;
+    return y->name;
+}
+
+lsym *lsym_get(char *name) {
+    return (lsym*)(name - offsetof(lsym, name));
+}
+
+typedef enum lop {
+    OP_CONST,
+    OP_LOCAL,
+    OP_LOOKUP,
+    OP_CALL,
+    OP_CALLG,
+    OP_TAILCALL,
+    OP_TAILCALLG,
+    OP_IF,
+    OP_WHILE,
+    OP_JUMP,
+    OP_POP,
+    OP_AND,
+    OP_OR,
+    OP_LET,
+    OP_LAMBDA,
+    OP_DEF,
+    OP_GUARD,
+    OP_GUARDT,
+    OP_TRY,
+    OP_UNTRY,
+    OP_CATCH,
+    OP_THROW,
+    OP_YIELD,
+    OP_NLOCAL,
+    OP_NCONST,
+    OP_NARITH,
+    OP_NBOX,
+    OP_NIF,
+    OP_MATCH,
+    OP_MLIST,
+    OP_MEQ,
+    OP_MCELL,
+    OP_MBIND,
+    OP_MREST,
+    OP_MDROP,
+    OP_ENTER,
+    OP_LOOP,
+    OP_EACH,
+    OP_QUASI,
+    OP_RET,
+
+    /* Quickened forms, rewritten in place by the VM and reverted to the
+       original instruction when their guard fails */
+    OP_GLOBAL,
+    OP_CALLG_GLOBAL,
+    OP_TAILCALLG_GLOBAL,
+    OP_ADD2,
+    OP_SUB2,
+    OP_MUL2,
+    OP_DIV2,
+    OP_MOD2,
+    OP_EQ2,
+    OP_NE2,
+    OP_LT2,
+    OP_GT2,
+    OP_LE2,
+    OP_GE2,
+} lop;
+
+typedef int ljit_fn(lenv*, int);
+
+struct lcode {
+    int refs;
+    int variadic;
+    int arity;
+    int count;
+    int *ops;
+    int *base_ops;
+    int consts_count;
+    lval **consts;
+    int loop;
+    int calls;
+    unsigned char *native;
+    int native_size;
+    ljit_fn *jit;
+};
+
+int lop_width(int op) {
+    switch (op) {
+        case OP_POP: case OP_UNTRY: case OP_THROW: case OP_YIELD:
+        case OP_NBOX: case OP_MATCH: case OP_RET: return 1;
+        case OP_LOOKUP: case OP_GLOBAL: case OP_AND: case OP_OR:
+        case OP_LET: case OP_DEF: case OP_CATCH: case OP_NLOCAL:
+        case OP_NCONST: case OP_NARITH: case OP_MREST: case OP_ENTER: return 3;
+        case OP_CALLG: case OP_TAILCALLG: case OP_CALLG_GLOBAL:
+        case OP_TAILCALLG_GLOBAL: case OP_GUARDT: case OP_MEQ: case OP_MCELL: return 4;
+        case OP_QUASI: return 4;
+        case OP_GUARD: case OP_MLIST: return 5;
+        default: return op >= OP_ADD2 ? 4 : 2;
+    }
+}
+
+typedef struct lframe {
+    lcode *code;
+    int pc;
+    lenv *env;
+    int owns_env;
+    int base;
+} lframe;
+
+/* An active try: the frame count and stack height to unwind to, and the
+   pc of its handler in the frame below */
+typedef struct ltry {
+    int fp;
+    int sp;
+    int pc;
+} ltry;
+
+typedef struct lvm {
+    int sp;
+    int stack_size;
+    lval **stack;
+    int fp;
+    int frames_size;
+    lframe *frames;
+    int tries_count;
+    int tries_size;
+    ltry *tries;
+} lvm;
+
+lvm vm = { 0, 0, NULL, 0, 0, NULL, 0, 0, NULL };
+
+/* A generator runs a call on a VM of its own, swapped in to resume it
+   and out again when it yields, so a suspended generator holds its frames
+   and stack but no C stack. Its frames see the global env. */
+struct lgen {
+    lvm vm;
+    lval *func;
+    lval *value;
+    int running;
+};
+
+lgen *lgen_active = NULL;
+
+/* Typed arithmetic keeps its intermediate numbers unboxed here. Nothing
+   runs between its instructions, so one array serves every frame. */
+#define LVM_NUMS 64
+long lvm_nums[LVM_NUMS];
+
+/* The parts of a value being matched, borrowed from the one on the stack */
+#define LVM_MATCH 64
+lval *lvm_match[LVM_MATCH];
+
+int lvm_frames_max = 1 << 20;
+
+/* Code entered this many times is translated to machine code */
+#ifdef LJIT
+int ljit_enabled = 1;
+#else
+int ljit_enabled = 0;
+#endif
+int ljit_threshold = 64;
+
+uintptr_t lstack_base = 0;
+uintptr_t lstack_size = 0;
+
+/* Guards the paths that still recurse in C: the tree walker and builtins
+   that evaluate code outside the VM */
+int lstack_exhausted(void) {
+    char here;
+    return lstack_base && lstack_base - (uintptr_t)&here > lstack_size;
+}
+
 void lval_print(lval *v);
+long lvnode_len(lvnode *n);
+lval *lvnode_get(lvnode *n, long i);
 
 void lval_expr_print(lval *v, char open, char close) {
     putchar(open);
@@ -122,10 +429,24 @@ void lval_print(lval *v) {
             if (v->builtin) {
                 printf("<function>");
             } else {
-                printf("(\\ "); lval_print(v->formals);
+                printf(v->macro ? "(macro " : "(\\ "); lval_print(v->formals);
                 putchar(' '); lval_print(v->body); putchar(')');
             }
             break;
+        case LVAL_SEQ:
+            printf("<sequence>");
+            break;
+        case LVAL_BOX:
+            printf("<box>");
+            break;
+        case LVAL_VEC:
+            putchar('[');
+            for (long i = 0, n = v->vec ? lvnode_len(v->vec) : 0; i < n; ++i) {
+                if (i) putchar(' ');
+                lval_print(lvnode_get(v->vec, i));
+            }
+            putchar(']');
+            break;
     }
 }
 
@@ -137,6 +458,9 @@ void lval_println(lval *v) {
 char *ltype_name(lval_type t) {
     switch(t) {
         case LVAL_FUN: return "Function";
+        case LVAL_SEQ: return "Sequence";
+        case LVAL_BOX: return "Box";
+        case LVAL_VEC: return "Vector";
         case LVAL_NUM: return "Number";
         case LVAL_ERR: return "Err";
         case LVAL_SYM: return "Symbol";
@@ -150,6 +474,9 @@ char *ltype_name(lval_type t) {
 lenv *lenv_new(void) {
     lenv  *e = malloc(sizeof(lenv));
     e->par = NULL;
+    e->ns = NULL;
+    e->module = NULL;
+    e->loop = 0;
     e->count = 0;
     e->syms = NULL;
     e->vals = NULL;
@@ -182,8 +509,7 @@ lval *lval_err(char *fmt, ...) {
 lval *lval_sym(char *s) {
     lval *v = (lval*) malloc(sizeof(lval));
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    v->sym = lsym_intern(s);
     return v;
 }
 
@@ -211,10 +537,21 @@ lval *lval_qexpr(void) {
     return v;
 }
 
+lval *lval_box(lval *x) {
+    lval *v = (lval*) malloc(sizeof(lval));
+    v->type = LVAL_BOX;
+    v->box = malloc(sizeof(lbox));
+    v->box->refs = 1;
+    v->box->value = x;
+    return v;
+}
+
 lval *lval_func(lbuiltin func) {
     lval *v = (lval*) malloc(sizeof(lval));
     v->type = LVAL_FUN;
     v->builtin = func;
+    v->memo = NULL;
+    v->macro = 0;
     return v;
 }
 
@@ -223,6 +560,10 @@ lval *lval_lambda(lval *formals, lval *body) {
     v->type = LVAL_FUN;
     v->builtin = NULL;
     v->env = lenv_new();
+    v->ns = NULL;
+    v->code = NULL;
+    v->memo = NULL;
+    v->macro = 0;
 
     v->formals = formals;
     v->body = body;
@@ -239,12 +580,23 @@ lval *lval_add(lval *v, lval *x) {
 }
 
 void lenv_del(lenv *e);
+void lcode_release(lcode *c);
+
+#ifdef LJIT
+size_t ljit_map_size(lcode *c);
+void ljit_compile(lcode *c);
+void ljit_count(lcode *c);
+#endif
+
+void lmemo_release(lmemo *m);
+void lseq_release(lseq *s);
+void lvnode_release(lvnode *n);
 
 void lval_del(lval *v) {
     switch (v->type) {
         case LVAL_NUM: break;
         case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
+        case LVAL_SYM: break;
         case LVAL_STR: free(v->str); break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
@@ -254,19 +606,29 @@ void lval_del(lval *v) {
             free(v->cell);
             break;
         case LVAL_FUN:
+            if (v->memo) lmemo_release(v->memo);
             if (!v->builtin) {
                 lenv_del(v->env);
                 lval_del(v->formals);
                 lval_del(v->body);
+                if (v->code) lcode_release(v->code);
+            }
+            break;
+        case LVAL_SEQ: lseq_release(v->seq); break;
+        case LVAL_BOX:
+            if (--v->box->refs == 0) {
+                lval_del(v->box->value);
+                free(v->box);
             }
             break;
+        case LVAL_VEC: lvnode_release(v->vec); break;
     }
     free(v);
 }
 
 void lenv_del(lenv *e) {
     for (int i = 0; i < e->count; ++i) {
-        free(e->syms[i]);
+        if (e != lroot) lsym_get(e->syms[i])->shadows--;
         lval_del(e->vals[i]);
     }
 
@@ -292,10 +654,24 @@ lval *lval_read_str(mpc_ast_t *t) {
     return str;
 }
 
+lval *lval_read(mpc_ast_t *t);
+
+/* Reads a quasiquote or unquote as the form it abbreviates. A quasiquote
+   always quotes its template as a Q-Expression. */
+lval *lval_read_quote(mpc_ast_t *t) {
+    int quasi = strstr(t->tag, "quasi") != NULL;
+    char *name = quasi ? "quasiquote" :
+        strcmp(t->children[0]->contents, ",@") == 0 ? "unquote-splicing" : "unquote";
+    lval *x = lval_read(t->children[1]);
+    if (quasi) x->type = LVAL_QEXPR;
+    return lval_add(lval_add(lval_sexpr(), lval_sym(name)), x);
+}
+
 lval *lval_read(mpc_ast_t *t) {
     if (strstr(t->tag, "number")) return lval_read_num(t);
     if (strstr(t->tag, "string")) return lval_read_str(t);
     if (strstr(t->tag, "symbol")) return lval_sym(t->contents);
+    if (strstr(t->tag, "quasi") || strstr(t->tag, "unquote")) return lval_read_quote(t);
 
     lval *x = NULL;
 
@@ -321,14 +697,88 @@ lval *lval_eval(lenv *e, lval *v);
 lval *lval_call(lenv *e, lval *f, lval *v);
 lval *lval_pop(lval *v, int i);
 lval *lenv_get(lenv *e, lval *k);
+lval *lenv_lookup(lenv *e, char *sym);
 lval *builtin(lenv *e, lval *a, char *func);
 
+lval *builtin_if(lenv *e, lval *a);
+lval *builtin_do(lenv *e, lval *a);
+lval *builtin_let(lenv *e, lval *a);
+lval *builtin_and(lenv *e, lval *a);
+lval *builtin_or(lenv *e, lval *a);
+lval *builtin_try(lenv *e, lval *a);
+lval *builtin_yield(lenv *e, lval *a);
+lval *builtin_while(lenv *e, lval *a);
+lval *builtin_dotimes(lenv *e, lval *a);
+lval *builtin_for_range(lenv *e, lval *a);
+lval *builtin_each(lenv *e, lval *a);
+lval *builtin_quasiquote(lenv *e, lval *a);
+
+/* Evaluates the operands of if, do, and, or and let only as far as needed.
+   Returns NULL, leaving v untouched, when v is an ordinary call. */
+lval *lval_eval_special(lenv *e, lbuiltin *func, lval *v) {
+    if (func == builtin_if && v->count == 4 &&
+            v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR) {
+        lval *c = lval_eval(e, lval_pop(v, 1));
+        if (c->type != LVAL_NUM) {
+            lval_del(v);
+            if (c->type == LVAL_ERR) return c;
+            lval *err = lval_err("Function '%s' passed incorrect type for argument %i. "
+                    "Got %s, Expected %s.",
+                    "if", 0, ltype_name(c->type), ltype_name(LVAL_NUM));
+            lval_del(c);
+            return err;
+        }
+        lval *branch = lval_pop(v, c->num ? 1 : 2);
+        lval_del(c);
+        lval_del(v);
+        branch->type = LVAL_SEXPR;
+        return lval_eval(e, branch);
+    }
+
+    if (func == builtin_let && v->count == 2 && v->cell[1]->type == LVAL_QEXPR) {
+        lval_del(lval_pop(v, 0));
+        return builtin_let(e, v);
+    }
+
+    int logic = func == builtin_and || func == builtin_or;
+    if (func != builtin_do && !logic) return NULL;
+
+    lval_del(lval_pop(v, 0));
+    for (int i = 0; v->count > 1; ++i) {
+        lval *x = lval_eval(e, lval_pop(v, 0));
+        if (logic && x->type == LVAL_NUM) {
+            if ((x->num != 0) == (func == builtin_or)) {
+                lval_del(v);
+                return x;
+            }
+        } else if (logic && x->type != LVAL_ERR) {
+            lval *err = lval_err("Function '%s' passed invalid type for argument %i. "
+                    "Got %s, Expected %s.",
+                    func == builtin_or ? "or" : "and", i,
+                    ltype_name(x->type), ltype_name(LVAL_NUM));
+            lval_del(x);
+            x = err;
+        }
+        if (x->type == LVAL_ERR) {
+            lval_del(v);
+            return x;
+        }
+        lval_del(x);
+    }
+    return lval_eval(e, lval_take(v, 0));
+}
+
 lval *lval_eval_sexpr(lenv *e, lval *v) {
-    for (int i = 0; i < v->count; ++i) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+    if (v->count > 1 && v->cell[0]->type == LVAL_SYM) {
+        lval *f = lenv_lookup(e, v->cell[0]->sym);
+        if (f && f->type == LVAL_FUN && f->builtin) {
+            lval *x = lval_eval_special(e, f->builtin, v);
+            if (x) return x;
+        }
     }
 
     for (int i = 0; i < v->count; ++i) {
+        v->cell[i] = lval_eval(e, v->cell[i]);
         if (v->cell[i]->type == LVAL_ERR) return lval_take(v, i);
     }
 
@@ -342,13 +792,77 @@ lval *lval_eval_sexpr(lenv *e, lval *v) {
         lval_del(v);
         return lval_err("S-expression does not start with function");
     }
+    if (f->macro) {
+        lval_del(f);
+        lval_del(v);
+        return lval_err("Macro called before it was defined");
+    }
 
     lval *result = lval_call(e, f, v);
     lval_del(f);
     return result;
 }
 
+/* Evaluation fuel. Every call, loop iteration and tree-walked form burns
+   a step from lfuel, so the common path is a decrement and a branch. When
+   a slice runs out, lfuel_refill charges it to the budget in force, checks
+   the deadline and hands out the next one. */
+#define LFUEL_SLICE 4096
+long lfuel = LFUEL_SLICE;
+long lfuel_budget = -1;
+long lfuel_deadline = 0;
+
+/* Limits for each evaluation started from the top level, 0 for none */
+long lfuel_step_limit = 0;
+long lfuel_time_limit = 0;
+
+long lclock_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* Called when lfuel goes below zero; charges the step that did so and
+   returns NULL, or returns an error once the budget or deadline is spent */
+lval *lfuel_refill(void) {
+    lfuel = 0;
+    if (lfuel_deadline && lclock_ms() >= lfuel_deadline) {
+        return lval_err("Evaluation deadline exceeded");
+    }
+    if (lfuel_budget == 0) return lval_err("Evaluation budget exceeded");
+
+    long slice = LFUEL_SLICE;
+    if (lfuel_budget > 0) {
+        if (slice > lfuel_budget) slice = lfuel_budget;
+        lfuel_budget -= slice;
+    }
+    lfuel = slice - 1;
+    return NULL;
+}
+
+/* The steps left before the budget is spent, or -1 without one */
+long lfuel_left(void) {
+    return lfuel_budget < 0 ? -1 : lfuel_budget + (lfuel > 0 ? lfuel : 0);
+}
+
+void lfuel_start(void) {
+    lfuel = 0;
+    lfuel_budget = lfuel_step_limit ? lfuel_step_limit : -1;
+    lfuel_deadline = lfuel_time_limit ? lclock_ms() + lfuel_time_limit : 0;
+}
+
 lval *lval_eval(lenv *e, lval *v) {
+    if (lstack_exhausted()) {
+        lval_del(v);
+        return lval_err("stack limit exceeded");
+    }
+    if (--lfuel < 0) {
+        lval *err = lfuel_refill();
+        if (err) {
+            lval_del(v);
+            return err;
+        }
+    }
     if (v->type == LVAL_SYM) {
         lval *x = lenv_get(e, v);
         lval_del(v);
@@ -377,19 +891,28 @@ lval *lval_take(lval *v, int i) {
 }
 
 lenv *lenv_copy(lenv *e);
+void lmemo_retain(lmemo *m);
+void lseq_retain(lseq *s);
+
 lval *lval_copy(lval *v) {
     lval *x = malloc(sizeof(lval));
     x->type = v->type;
 
     switch(v->type) {
         case LVAL_FUN:
+            x->macro = v->macro;
+            x->memo = v->memo;
+            if (x->memo) lmemo_retain(x->memo);
             if (v->builtin) {
                 x->builtin = v->builtin;
             } else {
                 x->builtin = NULL;
                 x->env = lenv_copy(v->env);
+                x->ns = v->ns;
                 x->formals = lval_copy(v->formals);
                 x->body = lval_copy(v->body);
+                x->code = v->code;
+                if (x->code) x->code->refs++;
             }
             break;
         case LVAL_NUM: x->num = v->num; break;
@@ -400,8 +923,7 @@ lval *lval_copy(lval *v) {
             break;
 
         case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym);
+            x->sym = v->sym;
             break;
 
         case LVAL_STR:
@@ -417,6 +939,21 @@ lval *lval_copy(lval *v) {
                 x->cell[i] = lval_copy(v->cell[i]);
             }
             break;
+
+        case LVAL_SEQ:
+            x->seq = v->seq;
+            lseq_retain(x->seq);
+            break;
+
+        case LVAL_BOX:
+            x->box = v->box;
+            x->box->refs++;
+            break;
+
+        case LVAL_VEC:
+            x->vec = v->vec;
+            if (x->vec) x->vec->refs++;
+            break;
     }
     return x;
 }
@@ -424,34 +961,364 @@ lval *lval_copy(lval *v) {
 lenv *lenv_copy(lenv *e) {
     lenv *n = malloc(sizeof(lenv));
     n->par = e->par;
+    n->ns = e->ns;
+    n->module = NULL;
+    n->loop = 0;
     n->count = e->count;
     n->syms = malloc(sizeof(char*) * n->count);
     n->vals = malloc(sizeof(lval*) * n->count);
     for (int i = 0; i < n->count; ++i) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
+        n->syms[i] = e->syms[i];
+        lsym_get(n->syms[i])->shadows++;
         n->vals[i] = lval_copy(e->vals[i]);
     }
     return n;
 }
 
-lval *lenv_get(lenv *e, lval *k) {
-    assert(k->type == LVAL_SYM);
+lvnode *lvnode_new(int height) {
+    lvnode *n = malloc(sizeof(lvnode));
+    n->refs = 1;
+    n->height = height;
+    n->count = 0;
+    n->sizes = height ? malloc(sizeof(long) * LVEC_M) : NULL;
+    return n;
+}
+
+void lvnode_release(lvnode *n) {
+    if (!n || --n->refs > 0) return;
+    for (int i = 0; i < n->count; ++i) {
+        if (n->height) {
+            lvnode_release(n->slot[i].kid);
+        } else {
+            lval_del(n->slot[i].val);
+        }
+    }
+    free(n->sizes);
+    free(n);
+}
+
+long lvnode_len(lvnode *n) {
+    return n->height ? n->sizes[n->count - 1] : n->count;
+}
+
+/* Appends the subtree k to the branch n, taking over its reference */
+void lvnode_add(lvnode *n, lvnode *k) {
+    n->sizes[n->count] = (n->count ? n->sizes[n->count - 1] : 0) + lvnode_len(k);
+    n->slot[n->count++].kid = k;
+}
+
+/* Appends slot i of src to n, sharing a subtree or copying a value */
+void lvnode_push(lvnode *n, lvnode *src, int i) {
+    if (src->height) {
+        src->slot[i].kid->refs++;
+        lvnode_add(n, src->slot[i].kid);
+    } else {
+        n->slot[n->count++].val = lval_copy(src->slot[i].val);
+    }
+}
+
+lvnode *lvnode_branch(int height, lvnode **kids, int count) {
+    lvnode *n = lvnode_new(height);
+    for (int i = 0; i < count; ++i) lvnode_add(n, kids[i]);
+    return n;
+}
+
+/* Returns the slot of n holding element *i and makes *i relative to it.
+   A branch of height h would hold 1 << (LVEC_BITS * h) elements per slot
+   if it were dense, so that guess is at most a few slots short. */
+int lvnode_find(lvnode *n, long *i) {
+    if (!n->height) return *i;
+    int j = *i >> (LVEC_BITS * n->height);
+    while (n->sizes[j] <= *i) j++;
+    if (j) *i -= n->sizes[j - 1];
+    return j;
+}
+
+lval *lvnode_get(lvnode *n, long i) {
+    while (n->height) n = n->slot[lvnode_find(n, &i)].kid;
+    return n->slot[i].val;
+}
+
+/* Returns n with element i replaced by x, which it takes over */
+lvnode *lvnode_set(lvnode *n, long i, lval *x) {
+    lvnode *r = lvnode_new(n->height);
+    int j = lvnode_find(n, &i);
+    for (int k = 0; k < n->count; ++k) {
+        if (k != j) {
+            lvnode_push(r, n, k);
+        } else if (n->height) {
+            lvnode_add(r, lvnode_set(n->slot[k].kid, i, x));
+        } else {
+            r->slot[r->count++].val = x;
+        }
+    }
+    return r;
+}
+
+/* The first k elements of n, for 0 < k <= its length */
+lvnode *lvnode_take(lvnode *n, long k) {
+    if (k == lvnode_len(n)) {
+        n->refs++;
+        return n;
+    }
+    lvnode *r = lvnode_new(n->height);
+    long i = k - 1;
+    int j = lvnode_find(n, &i);
+    for (int s = 0; s < j; ++s) lvnode_push(r, n, s);
+    if (n->height) {
+        lvnode_add(r, lvnode_take(n->slot[j].kid, i + 1));
+    } else {
+        lvnode_push(r, n, j);
+    }
+    return r;
+}
+
+/* n without its first k elements, for 0 <= k < its length */
+lvnode *lvnode_drop(lvnode *n, long k) {
+    if (k == 0) {
+        n->refs++;
+        return n;
+    }
+    lvnode *r = lvnode_new(n->height);
+    long i = k;
+    int j = lvnode_find(n, &i);
+    if (n->height) {
+        lvnode_add(r, lvnode_drop(n->slot[j].kid, i));
+    } else {
+        lvnode_push(r, n, j);
+    }
+    for (int s = j + 1; s < n->count; ++s) lvnode_push(r, n, s);
+    return r;
+}
+
+/* Strips branches with a single subtree off the top of a root */
+lvnode *lvnode_trim(lvnode *n) {
+    while (n && n->height && n->count == 1) {
+        lvnode *k = n->slot[0].kid;
+        k->refs++;
+        lvnode_release(n);
+        n = k;
+    }
+    return n;
+}
+
+/* Plans how joining redistributes the slots of the n equal height nodes
+   in all: each node short of LVEC_M - 1 slots is spread over the ones
+   after it until at most LVEC_EXTRAS more nodes remain than the slots
+   need. Fills sizes with the slot count of each node and returns how many
+   there are. */
+int lvnode_plan(lvnode **all, int n, int *sizes) {
+    int total = 0;
+    for (int i = 0; i < n; ++i) total += sizes[i] = all[i]->count;
+
+    int optimal = (total + LVEC_M - 1) / LVEC_M;
+    int i = 0;
+    while (n > optimal + LVEC_EXTRAS) {
+        while (sizes[i] > LVEC_M - 1) i++;
+        int rest = sizes[i];
+        do {
+            int size = rest + sizes[i + 1] < LVEC_M ? rest + sizes[i + 1] : LVEC_M;
+            rest += sizes[i + 1] - size;
+            sizes[i++] = size;
+        } while (rest > 0);
+        memmove(&sizes[i], &sizes[i + 1], sizeof(int) * (n - i - 1));
+        n--;
+        i--;
+    }
+    return n;
+}
+
+/* Joins the subtrees of c, which it takes over, between those of l and r
+   minus the last of l and the first of r that c was merged from */
+lvnode *lvnode_rebalance(lvnode *l, lvnode *c, lvnode *r, int top) {
+    lvnode *all[3 * LVEC_M];
+    int n = 0;
+    if (l) for (int i = 0; i < l->count - 1; ++i) all[n++] = l->slot[i].kid;
+    for (int i = 0; i < c->count; ++i) all[n++] = c->slot[i].kid;
+    if (r) for (int i = 1; i < r->count; ++i) all[n++] = r->slot[i].kid;
+
+    int sizes[3 * LVEC_M];
+    int m = lvnode_plan(all, n, sizes);
+
+    lvnode *out[3 * LVEC_M];
+    int from = 0, at = 0;
+    for (int k = 0; k < m; ++k) {
+        if (at == 0 && all[from]->count == sizes[k]) {
+            all[from]->refs++;
+            out[k] = all[from++];
+            continue;
+        }
+        out[k] = lvnode_new(all[from]->height);
+        while (out[k]->count < sizes[k]) {
+            lvnode_push(out[k], all[from], at++);
+            if (at == all[from]->count) {
+                from++;
+                at = 0;
+            }
+        }
+    }
+
+    int height = c->height;
+    lvnode_release(c);
+    if (m <= LVEC_M) {
+        lvnode *b = lvnode_branch(height, out, m);
+        return top ? b : lvnode_branch(height + 1, &b, 1);
+    }
+    lvnode *halves[2] = {
+        lvnode_branch(height, out, LVEC_M),
+        lvnode_branch(height, out + LVEC_M, m - LVEC_M),
+    };
+    return lvnode_branch(height + 1, halves, 2);
+}
+
+/* Merges the right edge of l with the left edge of r. Below the top the
+   result is one level above the higher of them, for the caller to splice
+   in place of its edge subtrees. */
+lvnode *lvnode_merge(lvnode *l, lvnode *r, int top) {
+    if (l->height > r->height) {
+        lvnode *c = lvnode_merge(l->slot[l->count - 1].kid, r, 0);
+        return lvnode_rebalance(l, c, NULL, top);
+    }
+    if (l->height < r->height) {
+        lvnode *c = lvnode_merge(l, r->slot[0].kid, 0);
+        return lvnode_rebalance(NULL, c, r, top);
+    }
+    if (l->height) {
+        lvnode *c = lvnode_merge(l->slot[l->count - 1].kid, r->slot[0].kid, 0);
+        return lvnode_rebalance(l, c, r, top);
+    }
+
+    if (l->count + r->count <= LVEC_M) {
+        lvnode *b = lvnode_new(0);
+        for (int i = 0; i < l->count; ++i) lvnode_push(b, l, i);
+        for (int i = 0; i < r->count; ++i) lvnode_push(b, r, i);
+        return top ? b : lvnode_branch(1, &b, 1);
+    }
+    l->refs++;
+    r->refs++;
+    lvnode *kids[2] = {l, r};
+    return lvnode_branch(1, kids, 2);
+}
+
+/* Joins two trees, either of which may be empty, into a new reference */
+lvnode *lvnode_concat(lvnode *l, lvnode *r) {
+    if (!l || !r) {
+        lvnode *n = l ? l : r;
+        if (n) n->refs++;
+        return n;
+    }
+    return lvnode_trim(lvnode_merge(l, r, 1));
+}
+
+/* Elements from up to to of n as a new reference */
+lvnode *lvnode_slice(lvnode *n, long from, long to) {
+    if (from >= to) return NULL;
+    lvnode *t = lvnode_take(n, to);
+    lvnode *d = lvnode_drop(t, from);
+    lvnode_release(t);
+    return lvnode_trim(d);
+}
+
+/* Builds a tree of the cells of l, which it takes over, level by level */
+lvnode *lvnode_build(lval *l) {
+    lvnode *root = NULL;
+    if (l->count) {
+        int n = (l->count + LVEC_M - 1) / LVEC_M;
+        lvnode **level = malloc(sizeof(lvnode*) * n);
+        for (int k = 0; k < n; ++k) {
+            level[k] = lvnode_new(0);
+            for (int i = k * LVEC_M; i < l->count && level[k]->count < LVEC_M; ++i) {
+                level[k]->slot[level[k]->count++].val = l->cell[i];
+            }
+        }
+        for (int height = 1; n > 1; ++height) {
+            int m = 0;
+            for (int k = 0; k < n; k += LVEC_M) {
+                level[m++] = lvnode_branch(height, level + k, n - k < LVEC_M ? n - k : LVEC_M);
+            }
+            n = m;
+        }
+        root = level[0];
+        free(level);
+    }
+    free(l->cell);
+    free(l);
+    return root;
+}
+
+void lvnode_fill(lvnode *n, lval **cells, long *at) {
+    for (int i = 0; i < n->count; ++i) {
+        if (n->height) {
+            lvnode_fill(n->slot[i].kid, cells, at);
+        } else {
+            cells[(*at)++] = lval_copy(n->slot[i].val);
+        }
+    }
+}
+
+lval *lval_vec(lvnode *root) {
+    lval *v = (lval*) malloc(sizeof(lval));
+    v->type = LVAL_VEC;
+    v->vec = root;
+    return v;
+}
+
+long lval_vec_len(lval *v) {
+    return v->vec ? lvnode_len(v->vec) : 0;
+}
+
+/* Copies the elements of the vector v into a new Q-Expression */
+lval *lval_vec_list(lval *v) {
+    lval *l = lval_qexpr();
+    long at = 0;
+    l->count = lval_vec_len(v);
+    l->cell = malloc(sizeof(lval*) * l->count);
+    if (v->vec) lvnode_fill(v->vec, l->cell, &at);
+    return l;
+}
 
+int lenv_find(lenv *e, char *sym) {
     for (int i = 0; i < e->count; ++i) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+        if (e->syms[i] == sym) return i;
+    }
+    return -1;
+}
+
+/* Returns the place holding the binding of sym that e sees, or NULL */
+lval **lenv_ref(lenv *e, char *sym) {
+    if (lroot && lsym_get(sym)->shadows == 0) e = lroot;
+    while (e) {
+        int i = lenv_find(e, sym);
+        if (i >= 0) return &e->vals[i];
+
+        /* Frames of functions defined inside a module see its private names */
+        if (e->ns) {
+            i = lenv_find(e->ns, sym);
+            if (i >= 0) return &e->ns->vals[i];
         }
+
+        e = e->par;
     }
+    return NULL;
+}
+
+lval *lenv_lookup(lenv *e, char *sym) {
+    lval **v = lenv_ref(e, sym);
+    return v ? *v : NULL;
+}
+
+lval *lenv_get(lenv *e, lval *k) {
+    assert(k->type == LVAL_SYM);
 
-    return e->par ? lenv_get(e->par, k) : lval_err("Unbound symbol '%s'!", k->sym);
+    lval *v = lenv_lookup(e, k->sym);
+    return v ? lval_copy(v) : lval_err("Unbound symbol '%s'!", k->sym);
 }
 
 void lenv_put(lenv *e, lval *k, lval *v) {
     assert(k->type == LVAL_SYM);
 
     for (int i = 0; i < e->count; ++i) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
+        if (e->syms[i] == k->sym) {
             lval_del(e->vals[i]);
             e->vals[i] = lval_copy(v);
             return;
@@ -463,13 +1330,17 @@ void lenv_put(lenv *e, lval *k, lval *v) {
     e->syms = realloc(e->syms, sizeof(char*) * e->count);
 
     e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+    e->syms[e->count - 1] = k->sym;
+    if (e != lroot) lsym_get(k->sym)->shadows++;
+}
+
+lenv *lenv_namespace(lenv *e) {
+    while (!e->module && !e->ns && e->par) e = e->par;
+    return e->ns ? e->ns : e;
 }
 
 void lenv_def(lenv *e, lval *k, lval *v) {
-    while (e->par) e = e->par;
-    lenv_put(e, k, v);
+    lenv_put(lenv_namespace(e), k, v);
 }
 
 lval *builtin_head(lenv *e, lval *a) {
@@ -478,6 +1349,12 @@ lval *builtin_head(lenv *e, lval *a) {
             "Function 'head' passed too many arguments. "
             "Got %i, Expected %i.",
             a->count, 1);
+    if (a->cell[0]->type == LVAL_VEC) {
+        LASSERT(a, a->cell[0]->vec, "Function '%s' passed []!", "head");
+        lval *x = lval_vec(lvnode_slice(a->cell[0]->vec, 0, 1));
+        lval_del(a);
+        return x;
+    }
     LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
             "Function 'head' passed incorrect type for argument 0. "
             "Got %s, Expected %s.",
@@ -497,6 +1374,12 @@ lval *builtin_tail(lenv *e, lval *a) {
             "Function 'tail' passed too many arguments. "
             "Got %i, Expected %i.",
             a->count, 1);
+    if (a->cell[0]->type == LVAL_VEC) {
+        LASSERT(a, a->cell[0]->vec, "Function '%s' passed []!", "tail");
+        lval *x = lval_vec(lvnode_slice(a->cell[0]->vec, 1, lval_vec_len(a->cell[0])));
+        lval_del(a);
+        return x;
+    }
     LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
             "Function 'tail' passed argument of incorrect type. "
             "Got %s, Expected %s.",
@@ -531,23 +1414,45 @@ lval *builtin_eval(lenv *e, lval *a) {
     return lval_eval(e, x);
 }
 
+/* Moves the cells of y to the end of x in one step */
 lval *lval_join(lval *x, lval *y) {
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+    if (y->count) {
+        x->cell = realloc(x->cell, sizeof(lval*) * (x->count + y->count));
+        memcpy(&x->cell[x->count], y->cell, sizeof(lval*) * y->count);
+        x->count += y->count;
     }
 
-    lval_del(y);
+    free(y->cell);
+    free(y);
     return x;
 }
 
+/* Joins vectors, and any lists among them, into one vector */
+lval *lvec_join(lval *a) {
+    lvnode *root = NULL;
+    for (int i = 0; i < a->count; ++i) {
+        int list = a->cell[i]->type == LVAL_QEXPR;
+        lvnode *n = list ? lvnode_build(lval_pop(a, i--)) : a->cell[i]->vec;
+        lvnode *r = lvnode_concat(root, n);
+        if (list) lvnode_release(n);
+        lvnode_release(root);
+        root = r;
+    }
+    lval_del(a);
+    return lval_vec(root);
+}
+
 lval *builtin_join(lenv *e, lval *a) {
     (void)e;
+    int vectors = 0;
     for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
+        vectors |= a->cell[i]->type == LVAL_VEC;
+        LASSERT(a, a->cell[i]->type == LVAL_QEXPR || a->cell[i]->type == LVAL_VEC,
                 "Function 'join' passed argument of incorrect type. "
                 "Got %s, Expected %s.",
                 ltype_name(a->cell[i]->type), ltype_name(LVAL_QEXPR));
     }
+    if (vectors) return lvec_join(a);
 
     lval *x = lval_qexpr();
 
@@ -559,8 +1464,92 @@ lval *builtin_join(lenv *e, lval *a) {
     return x;
 }
 
-lval *builtin_lambda(lenv *e, lval *a) {
+/* Quasiquote templates: `{...} and `(...) read as (quasiquote {...}), and
+   inside them ,x reads as (unquote x) and ,@x as (unquote-splicing x).
+   depth counts the quasiquotes enclosing a form, so only unquotes at
+   depth 1 are evaluated. */
+int lquasi_form(lval *y, char *name) {
+    return y->type == LVAL_SEXPR && y->count == 2 &&
+        y->cell[0]->type == LVAL_SYM && strcmp(y->cell[0]->sym, name) == 0;
+}
+
+int lquasi_depth(lval *y, int depth) {
+    if (lquasi_form(y, "quasiquote")) return depth + 1;
+    if (lquasi_form(y, "unquote") || lquasi_form(y, "unquote-splicing")) {
+        return depth - 1;
+    }
+    return depth;
+}
+
+lval *lquasi_splice_err(lval_type t) {
+    return lval_err("Function 'unquote-splicing' passed incorrect type. "
+            "Got %s, Expected %s.",
+            ltype_name(t), ltype_name(LVAL_QEXPR));
+}
+
+/* Adds the expansion of each cell of the template x to r; returns an
+   error or NULL */
+lval *lquasi_fill(lenv *e, lval *r, lval *x, int depth) {
+    for (int i = 0; i < x->count; ++i) {
+        lval *y = x->cell[i];
+        int splice = lquasi_form(y, "unquote-splicing");
+        if (depth == 1 && (splice || lquasi_form(y, "unquote"))) {
+            lval *v = lval_eval(e, lval_copy(y->cell[1]));
+            if (v->type == LVAL_ERR) return v;
+            if (!splice) {
+                lval_add(r, v);
+            } else if (v->type != LVAL_QEXPR) {
+                lval *err = lquasi_splice_err(v->type);
+                lval_del(v);
+                return err;
+            } else {
+                lval_join(r, v);
+            }
+            continue;
+        }
+        if (y->type != LVAL_SEXPR && y->type != LVAL_QEXPR) {
+            lval_add(r, lval_copy(y));
+            continue;
+        }
+        lval *z = y->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+        lval *err = lquasi_fill(e, z, y, lquasi_depth(y, depth));
+        if (err) {
+            lval_del(z);
+            return err;
+        }
+        lval_add(r, z);
+    }
+    return NULL;
+}
+
+lval *builtin_quasiquote(lenv *e, lval *a) {
+    LASSERT_NUM("quasiquote", a, 1);
+    LASSERT_TYPE("quasiquote", a, 0, LVAL_QEXPR);
+    lval *r = lval_qexpr();
+    lval *err = lquasi_fill(e, r, a->cell[0], 1);
+    lval_del(a);
+    if (err) {
+        lval_del(r);
+        return err;
+    }
+    return r;
+}
+
+lval *builtin_unquote(lenv *e, lval *a) {
+    (void)e;
+    lval_del(a);
+    return lval_err("Function 'unquote' used outside of quasiquote.");
+}
+
+lval *builtin_unquote_splicing(lenv *e, lval *a) {
     (void)e;
+    lval_del(a);
+    return lval_err("Function 'unquote-splicing' used outside of quasiquote.");
+}
+
+lcode *lval_compile(lenv *e, lval *f);
+
+lval *builtin_lambda(lenv *e, lval *a) {
     LASSERT_NUM("\\", a, 2);
     LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
     LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
@@ -575,17 +1564,95 @@ lval *builtin_lambda(lenv *e, lval *a) {
     lval *body = lval_pop(a, 0);
     lval_del(a);
 
-    return lval_lambda(formals, body);
+    lval *f = lval_lambda(formals, body);
+    lenv *ns = lenv_namespace(e);
+    if (ns->module) f->ns = ns;
+    lval_compile(e, f);
+    return f;
 }
 
-int lval_eq(lval *x, lval *y) {
-    if (x->type != y->type) return 0;
+lval *builtin_defmacro(lenv *e, lval *a) {
+    LASSERT_NUM("defmacro", a, 2);
+    LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR);
+    LASSERT(a, a->cell[0]->count > 0,
+            "Function 'defmacro' passed {} for argument 0.");
 
-    switch(x->type) {
-        case LVAL_NUM:
-            return x->num == y->num;
+    lval *name = lval_pop(a->cell[0], 0);
+    if (name->type != LVAL_SYM) {
+        lval_del(a);
+        lval *err = lval_err("Cannot define non-symbol. Got %s, Expected %s.",
+                ltype_name(name->type), ltype_name(LVAL_SYM));
+        lval_del(name);
+        return err;
+    }
 
-        case LVAL_ERR:
+    lval *f = builtin_lambda(e, a);
+    if (f->type == LVAL_FUN) {
+        f->macro = 1;
+        lenv_def(e, name, f);
+        lval_del(f);
+        f = lval_sexpr();
+    }
+    lval_del(name);
+    return f;
+}
+
+/* Fresh symbols start with '#', which cannot be written in source, so a
+   macro that binds one never captures a name used by its caller */
+lval *lgensym(char *sym, int len) {
+    static long count = 0;
+    char *name = malloc(len + 24);
+    sprintf(name, "#%.*s%li", len, sym, ++count);
+    lval *x = lval_sym(name);
+    free(name);
+    return x;
+}
+
+lval *builtin_gensym(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("gensym", a, 1);
+    LASSERT_TYPE("gensym", a, 0, LVAL_QEXPR);
+    LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+            "Function 'gensym' passed invalid name. Expected a single symbol.");
+
+    lval *x = lval_add(lval_qexpr(), lgensym(a->cell[0]->cell[0]->sym, strlen(a->cell[0]->cell[0]->sym)));
+    lval_del(a);
+    return x;
+}
+
+/* A macro introduces a temporary by writing its name with a trailing '#'.
+   Each expansion renames every such symbol in the macro's body to a fresh
+   gensym, the same one for each occurrence, before the body runs; names
+   pairs the symbols renamed so far with their gensyms. */
+void lmacro_rename(lval *x, lval *names) {
+    for (int i = 0; i < x->count; ++i) {
+        lval *y = x->cell[i];
+        if (y->type == LVAL_SEXPR || y->type == LVAL_QEXPR) {
+            lmacro_rename(y, names);
+            continue;
+        }
+        if (y->type != LVAL_SYM || y->sym[strlen(y->sym) - 1] != '#') continue;
+
+        int j = 0;
+        while (j < names->count && names->cell[j]->sym != y->sym) j += 2;
+        if (j == names->count) {
+            lval_add(names, lval_copy(y));
+            lval_add(names, lgensym(y->sym, strlen(y->sym) - 1));
+        }
+        x->cell[i] = lval_copy(names->cell[j + 1]);
+        lval_del(y);
+    }
+}
+
+int lval_eq(lval *x, lval *y) {
+    if (x->type != y->type) return 0;
+
+    switch(x->type) {
+        case LVAL_NUM:
+            return x->num == y->num;
+
+        case LVAL_ERR:
             return strcmp(x->err, y->err) == 0;
 
         case LVAL_SYM:
@@ -596,12 +1663,30 @@ int lval_eq(lval *x, lval *y) {
 
         case LVAL_FUN:
             if (x->builtin || y->builtin) {
-                return x->builtin == y->builtin;
+                return x->builtin == y->builtin && x->memo == y->memo;
             } else {
                 return lval_eq(x->formals, y->formals) &&
                     lval_eq(x->body, y->body);
             }
 
+        case LVAL_SEQ:
+            return x->seq == y->seq;
+
+        case LVAL_BOX:
+            return x->box == y->box;
+
+        case LVAL_VEC: {
+            long n = x->vec ? lvnode_len(x->vec) : 0;
+            if (x->vec == y->vec) return 1;
+            if (n != (y->vec ? lvnode_len(y->vec) : 0)) return 0;
+            for (long i = 0; i < n; ++i) {
+                if (!lval_eq(lvnode_get(x->vec, i), lvnode_get(y->vec, i))) {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+
         case LVAL_QEXPR:
         case LVAL_SEXPR:
             if (x->count != y->count) return 0;
@@ -698,59 +1783,343 @@ lval *builtin_if(lenv *e, lval *a) {
     return x;
 }
 
-lval *builtin_op(lenv *e, lval *a, char *op) {
+lval *builtin_do(lenv *e, lval *a) {
     (void)e;
+    if (a->count == 0) {
+        lval_del(a);
+        return lval_qexpr();
+    }
+    return lval_take(a, a->count - 1);
+}
+
+lval *builtin_select(lenv *e, lval *a) {
+    for (int i = 0; i < a->count; ++i) {
+        LASSERT_TYPE("select", a, i, LVAL_QEXPR);
+        LASSERT(a, a->cell[i]->count >= 2,
+                "Function 'select' passed clause without a value at argument %i.", i);
+    }
+
     for (int i = 0; i < a->count; ++i) {
+        lval *c = lval_eval(e, lval_copy(a->cell[i]->cell[0]));
+        if (c->type != LVAL_NUM) {
+            lval_del(a);
+            if (c->type == LVAL_ERR) return c;
+            lval *err = lval_err("Function '%s' passed incorrect type for argument %i. "
+                    "Got %s, Expected %s.",
+                    "if", 0, ltype_name(c->type), ltype_name(LVAL_NUM));
+            lval_del(c);
+            return err;
+        }
+        int chosen = c->num != 0;
+        lval_del(c);
+        if (chosen) {
+            lval *x = lval_eval(e, lval_pop(a->cell[i], 1));
+            lval_del(a);
+            return x;
+        }
+    }
+
+    lval_del(a);
+    return lval_err("No selection Found");
+}
+
+/* Patterns: _ matches anything, any other symbol binds what it matches, a
+   number or string matches an equal value, and a Q-Expression matches a
+   list of as many values, or at least as many before a trailing & rest */
+int lmatch_wild(lval *p) {
+    return p->type == LVAL_SYM && strcmp(p->sym, "_") == 0;
+}
+
+/* Returns the number of cells a list pattern matches one by one, setting
+   rest to the symbol after its &, or to NULL */
+int lmatch_list(lval *p, lval **rest) {
+    int n = p->count;
+    *rest = NULL;
+    if (n >= 2 && p->cell[n - 2]->type == LVAL_SYM && strcmp(p->cell[n - 2]->sym, "&") == 0) {
+        *rest = p->cell[n - 1];
+        n -= 2;
+    }
+    return n;
+}
+
+/* Adds the symbols p binds to vars; returns an error if p is no pattern */
+lval *lmatch_check(lval *p, lval *vars) {
+    switch (p->type) {
+        case LVAL_NUM:
+        case LVAL_STR:
+            return NULL;
+
+        case LVAL_SYM:
+            if (strcmp(p->sym, "&") == 0) {
+                return lval_err("Pattern format invalid. "
+                        "Symbol '&' not followed by single symbol.");
+            }
+            if (lmatch_wild(p)) return NULL;
+            for (int i = 0; i < vars->count; ++i) {
+                if (vars->cell[i]->sym == p->sym) {
+                    return lval_err("Pattern binds '%s' more than once.", p->sym);
+                }
+            }
+            lval_add(vars, lval_copy(p));
+            return NULL;
+
+        case LVAL_QEXPR: {
+            lval *rest;
+            int n = lmatch_list(p, &rest);
+            for (int i = 0; i < n; ++i) {
+                lval *err = lmatch_check(p->cell[i], vars);
+                if (err) return err;
+            }
+            if (rest && rest->type != LVAL_SYM) {
+                return lval_err("Pattern format invalid. "
+                        "Symbol '&' not followed by single symbol.");
+            }
+            return rest ? lmatch_check(rest, vars) : NULL;
+        }
+
+        default:
+            return lval_err("Pattern of type %s is not supported.", ltype_name(p->type));
+    }
+}
+
+/* Matches v against p, binding its variables in scope */
+int lmatch_bind(lenv *scope, lval *p, lval *v) {
+    if (p->type == LVAL_SYM) {
+        if (!lmatch_wild(p)) lenv_put(scope, p, v);
+        return 1;
+    }
+    if (p->type != LVAL_QEXPR) return lval_eq(p, v);
+
+    lval *rest;
+    int n = lmatch_list(p, &rest);
+    if (v->type != LVAL_QEXPR || v->count < n || (!rest && v->count != n)) return 0;
+    for (int i = 0; i < n; ++i) {
+        if (!lmatch_bind(scope, p->cell[i], v->cell[i])) return 0;
+    }
+    if (rest && !lmatch_wild(rest)) {
+        lval *r = lval_qexpr();
+        for (int i = n; i < v->count; ++i) lval_add(r, lval_copy(v->cell[i]));
+        lenv_put(scope, rest, r);
+        lval_del(r);
+    }
+    return 1;
+}
+
+lval *builtin_match(lenv *e, lval *a) {
+    LASSERT(a, a->count >= 1, "Function 'match' passed no value to match.");
+    for (int i = 1; i < a->count; ++i) {
+        LASSERT_TYPE("match", a, i, LVAL_QEXPR);
+        LASSERT(a, a->cell[i]->count == 2,
+                "Function 'match' passed clause without a pattern and a value at argument %i.", i);
+        lval *vars = lval_sexpr();
+        lval *err = lmatch_check(a->cell[i]->cell[0], vars);
+        lval_del(vars);
+        if (err) {
+            lval_del(a);
+            return err;
+        }
+    }
+
+    for (int i = 1; i < a->count; ++i) {
+        lenv *scope = lenv_new();
+        scope->par = e;
+        if (lmatch_bind(scope, a->cell[i]->cell[0], a->cell[0])) {
+            lval *x = lval_eval(scope, lval_copy(a->cell[i]->cell[1]));
+            lenv_del(scope);
+            lval_del(a);
+            return x;
+        }
+        lenv_del(scope);
+    }
+
+    lval_del(a);
+    return lval_err("No pattern matched");
+}
+
+lval *builtin_let(lenv *e, lval *a) {
+    LASSERT_NUM("let", a, 1);
+    LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+
+    lenv *scope = lenv_new();
+    scope->par = e;
+
+    lval *body = lval_take(a, 0);
+    body->type = LVAL_SEXPR;
+    lval *x = lval_eval(scope, body);
+    lenv_del(scope);
+    return x;
+}
+
+/* and/or return the first operand that decides the result, or the last */
+lval *builtin_logic(lenv *e, lval *a, char *op) {
+    (void)e;
+    int want = strcmp(op, "or") == 0;
+    for (int i = 0; i < a->count - 1; ++i) {
         LASSERT(a, a->cell[i]->type == LVAL_NUM,
                 "Function '%s' passed invalid type for argument %i. "
                 "Got %s, Expected %s.",
                 op, i, ltype_name(a->cell[i]->type), ltype_name(LVAL_NUM));
+        if ((a->cell[i]->num != 0) == want) return lval_take(a, i);
     }
+    return lval_take(a, a->count - 1);
+}
 
-    lval *x = lval_pop(a, 0);
-
-    if (strcmp(op, "-") == 0 && a->count == 0) {
-        x->num = -x->num;
-    }
+lval *builtin_and(lenv *e, lval *a) {
+    return builtin_logic(e, a, "and");
+}
 
-    while (a->count > 0) {
-        lval *y = lval_pop(a, 0);
+lval *builtin_or(lenv *e, lval *a) {
+    return builtin_logic(e, a, "or");
+}
 
-        if (strcmp(op, "+") == 0) x->num += y->num;
-        if (strcmp(op, "-") == 0) x->num -= y->num;
-        if (strcmp(op, "*") == 0) x->num *= y->num;
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x);
-                lval_del(y);
-                x = lval_err("Division by zero!");
-                break;
+/* Applies the binary arithmetic instruction op to x and y. Returns 1 when y
+   is a zero divisor or the result does not fit in a long, 0 otherwise. */
+int lnum_op(int op, long x, long y, long *r) {
+    switch (op) {
+        case OP_ADD2: return __builtin_add_overflow(x, y, r);
+        case OP_SUB2: return __builtin_sub_overflow(x, y, r);
+        case OP_MUL2: return __builtin_mul_overflow(x, y, r);
+        case OP_DIV2:
+        case OP_MOD2:
+            if (y == 0) return 1;
+            if (y == -1) {
+                /* LONG_MIN / -1 traps rather than wrapping */
+                if (op == OP_MOD2) *r = 0;
+                return op == OP_DIV2 && __builtin_sub_overflow(0, x, r);
             }
-            x->num /= y->num;
-        }
-        lval_del(y);
+            *r = op == OP_DIV2 ? x / y : x % y;
+            return 0;
+        case OP_EQ2: *r = x == y; return 0;
+        case OP_NE2: *r = x != y; return 0;
+        case OP_LT2: *r = x < y; return 0;
+        case OP_GT2: *r = x > y; return 0;
+        case OP_LE2: *r = x <= y; return 0;
+        case OP_GE2: *r = x >= y; return 0;
     }
+    return 1;
+}
+
+/* The error lnum_op failed with for the divisor y: only division can fail
+   with a zero right operand */
+lval *lnum_err(long y) {
+    return y == 0 ? lval_err("Division by zero!") : lval_err("Integer overflow!");
+}
+
+/* Returns the first argument of a set to r, reusing its cell */
+lval *lval_num_result(lval *a, long r) {
+    lval *x = a->cell[0];
+    x->num = r;
+    a->cell[0] = a->cell[--a->count];
     lval_del(a);
     return x;
 }
 
+/* Folds op over the arguments left to right in a single pass, in place.
+   Two numbers, the common case, skip the checks and the loop. */
+lval *builtin_arith(lval *a, char *func, int op) {
+    long r;
+    if (a->count == 2 && a->cell[0]->type == LVAL_NUM &&
+            a->cell[1]->type == LVAL_NUM &&
+            !lnum_op(op, a->cell[0]->num, a->cell[1]->num, &r)) {
+        return lval_num_result(a, r);
+    }
+
+    LASSERT(a, a->count > 0, "Function '%s' passed no arguments.", func);
+    for (int i = 0; i < a->count; ++i) {
+        LASSERT(a, a->cell[i]->type == LVAL_NUM,
+                "Function '%s' passed invalid type for argument %i. "
+                "Got %s, Expected %s.",
+                func, i, ltype_name(a->cell[i]->type), ltype_name(LVAL_NUM));
+    }
+
+    r = a->cell[0]->num;
+    if (a->count == 1 && op == OP_SUB2 && lnum_op(OP_SUB2, 0, r, &r)) {
+        lval_del(a);
+        return lnum_err(-1);
+    }
+    for (int i = 1; i < a->count; ++i) {
+        long y = a->cell[i]->num;
+        if (lnum_op(op, r, y, &r)) {
+            lval_del(a);
+            return lnum_err(y);
+        }
+    }
+    return lval_num_result(a, r);
+}
+
 lval *builtin_add(lenv *e, lval *a) {
-    return builtin_op(e, a, "+");
+    (void)e;
+    return builtin_arith(a, "+", OP_ADD2);
 }
 
 lval *builtin_sub(lenv *e, lval *a) {
-    return builtin_op(e, a, "-");
+    (void)e;
+    return builtin_arith(a, "-", OP_SUB2);
 }
 
 lval *builtin_mul(lenv *e, lval *a) {
-    return builtin_op(e, a, "*");
+    (void)e;
+    return builtin_arith(a, "*", OP_MUL2);
 }
 
 lval *builtin_div(lenv *e, lval *a) {
-    return builtin_op(e, a, "/");
+    (void)e;
+    return builtin_arith(a, "/", OP_DIV2);
+}
+
+lval *builtin_mod(lenv *e, lval *a) {
+    (void)e;
+    return builtin_arith(a, "%", OP_MOD2);
 }
 
+/* min and max keep the first argument that op prefers over all the others */
+lval *builtin_extremum(lval *a, char *func, int op) {
+    LASSERT(a, a->count > 0, "Function '%s' passed no arguments.", func);
+    for (int i = 0; i < a->count; ++i) {
+        LASSERT(a, a->cell[i]->type == LVAL_NUM,
+                "Function '%s' passed invalid type for argument %i. "
+                "Got %s, Expected %s.",
+                func, i, ltype_name(a->cell[i]->type), ltype_name(LVAL_NUM));
+    }
+
+    long r = a->cell[0]->num;
+    for (int i = 1; i < a->count; ++i) {
+        long better;
+        lnum_op(op, a->cell[i]->num, r, &better);
+        if (better) r = a->cell[i]->num;
+    }
+    return lval_num_result(a, r);
+}
+
+lval *builtin_min(lenv *e, lval *a) {
+    (void)e;
+    return builtin_extremum(a, "min", OP_LT2);
+}
+
+lval *builtin_max(lenv *e, lval *a) {
+    (void)e;
+    return builtin_extremum(a, "max", OP_GT2);
+}
+
+lval *builtin_abs(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("abs", a, 1);
+    LASSERT_TYPE("abs", a, 0, LVAL_NUM);
+
+    long r = a->cell[0]->num;
+    if (r < 0 && lnum_op(OP_SUB2, 0, r, &r)) {
+        lval_del(a);
+        return lnum_err(-1);
+    }
+    return lval_num_result(a, r);
+}
+
+lval *lvm_exec(lenv *e, lcode *c);
+
+lval *lmemo_call(lenv *e, lmemo *m, lval *a);
+
 lval *lval_call(lenv *e, lval *f, lval *a) {
+    if (f->memo) return lmemo_call(e, f->memo, a);
     if (f->builtin) return f->builtin(e, a);
     int given = a->count;
     int total = f->formals->count;
@@ -806,119 +2175,4186 @@ lval *lval_call(lenv *e, lval *f, lval *a) {
 
     if (f->formals->count == 0) {
         f->env->par = e;
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+        f->env->ns = f->ns;
+        return lvm_exec(f->env, lval_compile(e, f));
     } else {
         return lval_copy(f);
     }
 }
 
-lval *builtin_var(lenv *e, lval *a, char *func) {
-    assert(a->type == LVAL_SEXPR);
-    assert(a->count > 0);
-    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+/* Memoized functions share a table of results keyed on their arguments.
+   Entries are chained by hash and kept in least recently used order, the
+   oldest being evicted once the table holds capacity results. */
+typedef struct lmemo_entry {
+    unsigned long hash;
+    lval *args;
+    lval *result;
+    struct lmemo_entry *chain;
+    struct lmemo_entry *newer;
+    struct lmemo_entry *older;
+} lmemo_entry;
+
+struct lmemo {
+    int refs;
+    lval *func;
+    int capacity;
+    int count;
+    int buckets_size;
+    lmemo_entry **buckets;
+    lmemo_entry *newest;
+    lmemo_entry *oldest;
+    long hits;
+    long misses;
+    long evictions;
+};
 
-    lval *syms = a->cell[0];
+unsigned long lval_hash(lval *v);
 
-    for (int i = 0; i < syms->count; ++i) {
-        LASSERT(a, syms->cell[i]->type == LVAL_SYM,
-                "Function '%s' passed invalid type for argument %i. "
-                "Got %s, Expected %s.",
-                func, i, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+/* Folds the elements of a vector into h in order, as for a list */
+void lvnode_hash(lvnode *n, unsigned long *h) {
+    for (int i = 0; i < n->count; ++i) {
+        if (n->height) {
+            lvnode_hash(n->slot[i].kid, h);
+        } else {
+            *h = (*h ^ lval_hash(n->slot[i].val)) * 1099511628211UL;
+        }
     }
+}
 
-    LASSERT(a, syms->count == a->count - 1,
-            "Incorrect no. of arguments to function '%s'. "
-            "Symbols: %i, Values: %i.",
-            func, syms->count, a->count - 1);
-
-    for (int i = 0; i < syms->count; ++i) {
-        if (strcmp(func, "def") == 0) {
-            lenv_def(e, syms->cell[i], a->cell[i+1]);
-        }
-        if (strcmp(func, "=") == 0) {
-            lenv_put(e, syms->cell[i], a->cell[i+1]);
-        }
+unsigned long lval_hash(lval *v) {
+    unsigned long h = 14695981039346656037UL ^ v->type;
+    switch (v->type) {
+        case LVAL_NUM: h ^= (unsigned long)v->num; break;
+        case LVAL_SYM: h ^= (uintptr_t)v->sym; break;
+        case LVAL_SEQ: h ^= (uintptr_t)v->seq; break;
+        case LVAL_BOX: h ^= (uintptr_t)v->box; break;
+        case LVAL_VEC: if (v->vec) lvnode_hash(v->vec, &h); break;
+        case LVAL_ERR:
+        case LVAL_STR:
+            for (char *s = v->type == LVAL_ERR ? v->err : v->str; *s; ++s) {
+                h = (h ^ (unsigned char)*s) * 1099511628211UL;
+            }
+            break;
+        case LVAL_FUN:
+            h ^= v->builtin ? (uintptr_t)v->builtin : lval_hash(v->body);
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; ++i) {
+                h = (h ^ lval_hash(v->cell[i])) * 1099511628211UL;
+            }
+            break;
     }
+    return h * 1099511628211UL;
+}
 
-    lval_del(a);
-    return lval_sexpr();
+lmemo *lmemo_new(lval *func, int capacity) {
+    lmemo *m = malloc(sizeof(lmemo));
+    m->refs = 1;
+    m->func = func;
+    m->capacity = capacity;
+    m->count = 0;
+    m->buckets_size = 16;
+    m->buckets = calloc(m->buckets_size, sizeof(lmemo_entry*));
+    m->newest = NULL;
+    m->oldest = NULL;
+    m->hits = 0;
+    m->misses = 0;
+    m->evictions = 0;
+    return m;
 }
 
-lval *builtin_def(lenv *e, lval *a) {
-    return builtin_var(e, a, "def");
+void lmemo_retain(lmemo *m) {
+    m->refs++;
 }
 
-lval *builtin_put(lenv *e, lval *a) {
-    return builtin_var(e, a, "=");
+void lmemo_unlink(lmemo *m, lmemo_entry *x) {
+    if (x->newer) x->newer->older = x->older; else m->newest = x->older;
+    if (x->older) x->older->newer = x->newer; else m->oldest = x->newer;
 }
 
-lval *builtin(lenv *e, lval *a, char *func) {
-    if (strcmp("list", func) == 0) return builtin_list(e, a);
-    if (strcmp("head", func) == 0) return builtin_head(e, a);
-    if (strcmp("tail", func) == 0) return builtin_tail(e, a);
-    if (strcmp("eval", func) == 0) return builtin_eval(e, a);
-    if (strcmp("join", func) == 0) return builtin_join(e, a);
-    if (strstr("+-*/", func)) return builtin_op(e, a, func);
-    lval_del(a);
-    return lval_err("Unknown function!");
+void lmemo_push(lmemo *m, lmemo_entry *x) {
+    x->newer = NULL;
+    x->older = m->newest;
+    if (m->newest) m->newest->newer = x; else m->oldest = x;
+    m->newest = x;
 }
 
-lval *builtin_load(lenv *e, lval *a) {
-    LASSERT_NUM("load", a, 1);
-    LASSERT_TYPE("load", a, 0, LVAL_STR);
+void lmemo_evict(lmemo *m, lmemo_entry *x) {
+    lmemo_entry **p = &m->buckets[x->hash & (m->buckets_size - 1)];
+    while (*p != x) p = &(*p)->chain;
+    *p = x->chain;
+    lmemo_unlink(m, x);
+    lval_del(x->args);
+    lval_del(x->result);
+    free(x);
+    m->count--;
+}
 
-    mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-        lval *expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+void lmemo_release(lmemo *m) {
+    if (--m->refs) return;
+    while (m->oldest) lmemo_evict(m, m->oldest);
+    free(m->buckets);
+    lval_del(m->func);
+    free(m);
+}
 
-        while (expr->count) {
-            lval *x = lval_eval(e, lval_pop(expr, 0));
-            if (x->type == LVAL_ERR) lval_println(x);
-            lval_del(x);
+void lmemo_grow(lmemo *m) {
+    int size = m->buckets_size * 2;
+    lmemo_entry **buckets = calloc(size, sizeof(lmemo_entry*));
+    for (int i = 0; i < m->buckets_size; ++i) {
+        lmemo_entry *x = m->buckets[i];
+        while (x) {
+            lmemo_entry *next = x->chain;
+            x->chain = buckets[x->hash & (size - 1)];
+            buckets[x->hash & (size - 1)] = x;
+            x = next;
         }
+    }
+    free(m->buckets);
+    m->buckets = buckets;
+    m->buckets_size = size;
+}
 
-        lval_del(expr);
-        lval_del(a);
-
-        return lval_sexpr();
-    } else {
-        char *err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
+lval *lmemo_call(lenv *e, lmemo *m, lval *a) {
+    unsigned long hash = lval_hash(a);
+    for (lmemo_entry *x = m->buckets[hash & (m->buckets_size - 1)]; x; x = x->chain) {
+        if (x->hash == hash && lval_eq(x->args, a)) {
+            m->hits++;
+            lmemo_unlink(m, x);
+            lmemo_push(m, x);
+            lval_del(a);
+            return lval_copy(x->result);
+        }
+    }
 
-        lval *err = lval_err("Could not load library %s", err_msg);
-        free(err_msg);
-        lval_del(a);
+    m->misses++;
+    m->refs++;
+    lval *args = lval_copy(a);
+    lval *f = lval_copy(m->func);
+    lval *r = lval_call(e, f, a);
+    lval_del(f);
+    if (r->type == LVAL_ERR) {
+        lval_del(args);
+        lmemo_release(m);
+        return r;
+    }
 
-        return err;
+    if (m->count >= m->capacity) {
+        lmemo_evict(m, m->oldest);
+        m->evictions++;
     }
+    if (m->count >= m->buckets_size) lmemo_grow(m);
+    lmemo_entry *x = malloc(sizeof(lmemo_entry));
+    x->hash = hash;
+    x->args = args;
+    x->result = lval_copy(r);
+    x->chain = m->buckets[hash & (m->buckets_size - 1)];
+    m->buckets[hash & (m->buckets_size - 1)] = x;
+    lmemo_push(m, x);
+    m->count++;
+    lmemo_release(m);
+    return r;
 }
 
-lval *builtin_error(lenv *e, lval *a) {
-    (void)e;
-    LASSERT_NUM("error", a, 1);
-    LASSERT_TYPE("error", a, 0, LVAL_STR);
+/* Lazy sequences are shared chains of cells. A cell starts out holding
+   how to produce its element, and is overwritten with the element and
+   the next cell the first time it is realized, so every copy of the
+   sequence sees work done through any other. */
+enum { LSEQ_DONE, LSEQ_RANGE, LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE, LSEQ_GEN };
+
+struct lseq {
+    int refs;
+    int kind;
+    lval *first;
+    lseq *rest;
+    long from, to, step;
+    lval *func;
+    lseq *src;
+    lgen *gen;
+};
 
-    lval *err = lval_err(a->cell[0]->str);
-    lval_del(a);
+void lgen_del(lgen *g);
+lval *lgen_resume(lgen *g);
 
-    return err;
+lseq *lseq_new(int kind) {
+    lseq *s = calloc(1, sizeof(lseq));
+    s->refs = 1;
+    s->kind = kind;
+    return s;
 }
 
-lval *builtin_print(lenv *e, lval *a) {
-    (void)e;
-    for (int i = 0; i < a->count; ++i) {
-        lval_print(a->cell[i]);
-        putchar(' ');
-    }
-
-    putchar('\n');
-    lval_del(a);
+void lseq_retain(lseq *s) {
+    s->refs++;
+}
 
-    return lval_sexpr();
+void lseq_release(lseq *s) {
+    while (s && --s->refs == 0) {
+        lseq *next = s->kind == LSEQ_DONE ? s->rest : s->src;
+        if (s->first) lval_del(s->first);
+        if (s->func) lval_del(s->func);
+        if (s->gen) lgen_del(s->gen);
+        free(s);
+        s = next;
+    }
 }
 
-void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
+lval *lval_seq(lseq *s) {
+    lval *v = malloc(sizeof(lval));
+    v->type = LVAL_SEQ;
+    v->seq = s;
+    return v;
+}
+
+/* Only s owns its source once it is realized */
+lseq *lseq_chain(lseq *s, int kind, lseq *src) {
+    lseq *r = lseq_new(kind);
+    r->from = s->from;
+    r->to = s->to;
+    r->step = s->step;
+    r->src = src;
+    if (src) lseq_retain(src);
+    if (s->func) r->func = lval_copy(s->func);
+    return r;
+}
+
+void lseq_done(lseq *s, lval *first, lseq *rest) {
+    if (s->func) lval_del(s->func);
+    if (s->gen) lgen_del(s->gen);
+    lseq_release(s->src);
+    s->func = NULL;
+    s->src = NULL;
+    s->gen = NULL;
+    s->kind = LSEQ_DONE;
+    s->first = first;
+    s->rest = rest;
+}
+
+lseq *lseq_from_list(lval *l) {
+    lseq *s = lseq_new(LSEQ_DONE);
+    for (int i = l->count - 1; i >= 0; --i) {
+        lseq *x = lseq_new(LSEQ_DONE);
+        x->first = lval_copy(l->cell[i]);
+        x->rest = s;
+        s = x;
+    }
+    return s;
+}
+
+lval *lseq_apply(lenv *e, lval *f, lval *x) {
+    lval *g = lval_copy(f);
+    lval *r = lval_call(e, g, lval_add(lval_sexpr(), x));
+    lval_del(g);
+    return r;
+}
+
+/* Realizes the first cell of s, returning an error if one was raised.
+   Each cell realized or filtered out burns a step, so forcing or folding
+   an endless sequence stops at the evaluation budget. */
+lval *lseq_realize(lenv *e, lseq *s) {
+    while (s->kind != LSEQ_DONE) {
+        if (--lfuel < 0) {
+            lval *err = lfuel_refill();
+            if (err) return err;
+        }
+        if (s->kind == LSEQ_RANGE) {
+            if (s->step > 0 ? s->from >= s->to : s->from <= s->to) {
+                lseq_done(s, NULL, NULL);
+            } else {
+                lseq *rest = lseq_chain(s, LSEQ_RANGE, NULL);
+                rest->from += s->step;
+                lseq_done(s, lval_num(s->from), rest);
+            }
+            break;
+        }
+
+        if (s->kind == LSEQ_GEN) {
+            lval *x = lgen_resume(s->gen);
+            if (x && x->type == LVAL_ERR) return x;
+            lseq *rest = NULL;
+            if (x) {
+                rest = lseq_new(LSEQ_GEN);
+                rest->gen = s->gen;
+                s->gen = NULL;
+            }
+            lseq_done(s, x, rest);
+            break;
+        }
+
+        if (s->kind == LSEQ_TAKE && s->from <= 0) {
+            lseq_done(s, NULL, NULL);
+            break;
+        }
+        lval *err = lseq_realize(e, s->src);
+        if (err) return err;
+        lseq *src = s->src;
+        if (!src->first) {
+            lseq_done(s, NULL, NULL);
+            break;
+        }
+
+        if (s->kind == LSEQ_FILTER) {
+            lval *keep = lseq_apply(e, s->func, lval_copy(src->first));
+            if (keep->type == LVAL_ERR) return keep;
+            if (keep->type != LVAL_NUM) {
+                lval *err = lval_err("Function 'lfilter' predicate returned %s, Expected %s.",
+                        ltype_name(keep->type), ltype_name(LVAL_NUM));
+                lval_del(keep);
+                return err;
+            }
+            int pass = keep->num != 0;
+            lval_del(keep);
+            if (!pass) {
+                s->src = src->rest;
+                lseq_retain(s->src);
+                lseq_release(src);
+                continue;
+            }
+        }
+
+        lval *first = lval_copy(src->first);
+        if (s->kind == LSEQ_MAP) {
+            first = lseq_apply(e, s->func, first);
+            if (first->type == LVAL_ERR) return first;
+        }
+        lseq *rest = lseq_chain(s, s->kind, src->rest);
+        if (s->kind == LSEQ_TAKE) rest->from--;
+        lseq_done(s, first, rest);
+    }
+    return NULL;
+}
+
+lcode *lcode_new(void) {
+    lcode *c = malloc(sizeof(lcode));
+    c->refs = 1;
+    c->variadic = 0;
+    c->arity = -1;
+    c->count = 0;
+    c->ops = NULL;
+    c->base_ops = NULL;
+    c->consts_count = 0;
+    c->consts = NULL;
+    c->loop = 0;
+    c->calls = 0;
+    c->native = NULL;
+    c->native_size = 0;
+    c->jit = NULL;
+    return c;
+}
+
+void lcode_release(lcode *c) {
+    if (--c->refs > 0) return;
+    for (int i = 0; i < c->consts_count; ++i) {
+        lval_del(c->consts[i]);
+    }
+    free(c->consts);
+    free(c->ops);
+    free(c->base_ops);
+#ifdef LJIT
+    if (c->native) munmap(c->native, ljit_map_size(c));
+#endif
+    free(c);
+}
+
+typedef struct lcomp {
+    lcode *code;
+    lenv *env;
+    int slots_count;
+    char **slots;
+} lcomp;
+
+int lcomp_emit(lcomp *k, int word) {
+    lcode *c = k->code;
+    c->count++;
+    c->ops = realloc(c->ops, sizeof(int) * c->count);
+    c->ops[c->count - 1] = word;
+    return c->count - 1;
+}
+
+int lcomp_const(lcomp *k, lval *v) {
+    lcode *c = k->code;
+    c->consts_count++;
+    c->consts = realloc(c->consts, sizeof(lval*) * c->consts_count);
+    c->consts[c->consts_count - 1] = v;
+    return c->consts_count - 1;
+}
+
+int lcomp_slot(lcomp *k, char *sym) {
+    for (int i = 0; i < k->slots_count; ++i) {
+        if (k->slots[i] == sym) return i;
+    }
+    return -1;
+}
+
+/* Special forms are only compiled while their name is bound to the builtin */
+int lcomp_special(lcomp *k, lval *x, lbuiltin *func) {
+    if (x->type != LVAL_SYM || lcomp_slot(k, x->sym) >= 0) return 0;
+    lval *f = lenv_lookup(k->env, x->sym);
+    return f && f->type == LVAL_FUN && f->builtin == func;
+}
+
+void lcomp_sexpr(lcomp *k, lval *x, int tail);
+lval *builtin_def(lenv *e, lval *a);
+lval *builtin_put(lenv *e, lval *a);
+
+void lcomp_expr(lcomp *k, lval *x, int tail) {
+    if (x->type == LVAL_SYM) {
+        int slot = lcomp_slot(k, x->sym);
+        if (slot >= 0) {
+            lcomp_emit(k, OP_LOCAL);
+            lcomp_emit(k, slot);
+        } else {
+            lcomp_emit(k, OP_LOOKUP);
+            lcomp_emit(k, lcomp_const(k, lval_copy(x)));
+            lcomp_emit(k, 0);
+        }
+        return;
+    }
+    if (x->type == LVAL_SEXPR) {
+        lcomp_sexpr(k, x, tail);
+        return;
+    }
+    lcomp_emit(k, OP_CONST);
+    lcomp_emit(k, lcomp_const(k, lval_copy(x)));
+    if (x->type == LVAL_ERR) lcomp_emit(k, OP_THROW);
+}
+
+int lcomp_typed(lcomp *k, lval *x, lval *deps, lval *slots, int depth);
+void lcomp_typed_emit(lcomp *k, lval *x, int depth);
+int *lcomp_guards(lcomp *k, lval *deps);
+int *lcomp_type_guards(lcomp *k, lval *slots);
+void lcomp_patch(lcomp *k, int *at, int n);
+
+/* A typed condition is tested unboxed, with the checked test placed after
+   the branches for when its guards fail */
+void lcomp_branch(lcomp *k, lval *x, int tail) {
+    lval *deps = lval_sexpr();
+    lval *slots = lval_sexpr();
+    int typed = lcomp_typed(k, x->cell[1], deps, slots, 0);
+    int *at = NULL;
+    int *types = NULL;
+    if (typed) {
+        at = lcomp_guards(k, deps);
+        types = lcomp_type_guards(k, slots);
+        lcomp_typed_emit(k, x->cell[1], 0);
+        lcomp_emit(k, OP_NIF);
+    } else {
+        lcomp_expr(k, x->cell[1], 0);
+        lcomp_emit(k, OP_IF);
+    }
+    int else_at = lcomp_emit(k, 0);
+    int then = k->code->count;
+    lcomp_sexpr(k, x->cell[2], tail);
+    lcomp_emit(k, OP_JUMP);
+    int jump_at = lcomp_emit(k, 0);
+    k->code->ops[else_at] = k->code->count;
+    lcomp_sexpr(k, x->cell[3], tail);
+
+    if (typed) {
+        lcomp_emit(k, OP_JUMP);
+        int end = lcomp_emit(k, 0);
+        lcomp_patch(k, at, deps->count);
+        lcomp_patch(k, types, slots->count);
+        lcomp_expr(k, x->cell[1], 0);
+        lcomp_emit(k, OP_IF);
+        lcomp_emit(k, k->code->ops[else_at]);
+        lcomp_emit(k, OP_JUMP);
+        lcomp_emit(k, then);
+        k->code->ops[end] = k->code->count;
+    }
+    k->code->ops[jump_at] = k->code->count;
+    lval_del(deps);
+    lval_del(slots);
+}
+
+void lcomp_do(lcomp *k, lval *x, int tail) {
+    for (int i = 1; i < x->count - 1; ++i) {
+        lcomp_expr(k, x->cell[i], 0);
+        lcomp_emit(k, OP_POP);
+    }
+    lcomp_expr(k, x->cell[x->count - 1], tail);
+}
+
+void lcomp_logic(lcomp *k, lval *x, int op, int tail) {
+    int *ends = malloc(sizeof(int) * x->count);
+    for (int i = 1; i < x->count - 1; ++i) {
+        lcomp_expr(k, x->cell[i], 0);
+        lcomp_emit(k, op);
+        lcomp_emit(k, i - 1);
+        ends[i] = lcomp_emit(k, 0);
+    }
+    lcomp_expr(k, x->cell[x->count - 1], tail);
+    for (int i = 1; i < x->count - 1; ++i) {
+        k->code->ops[ends[i]] = k->code->count;
+    }
+    free(ends);
+}
+
+/* The body of a let and the lambda of a \ are compiled along with the
+   enclosing code and kept in its constant pool */
+void lcomp_let(lcomp *k, lval *x, int tail) {
+    lval *f = lval_lambda(lval_qexpr(), lval_copy(x->cell[1]));
+    lval_compile(k->env, f);
+    lcomp_emit(k, OP_LET);
+    lcomp_emit(k, lcomp_const(k, f));
+    lcomp_emit(k, tail);
+}
+
+/* The body of a try runs inline between OP_TRY and OP_UNTRY; the handler
+   is a lambda of one formal, err, entered by OP_CATCH with the message */
+void lcomp_try(lcomp *k, lval *x, int tail) {
+    lcomp_emit(k, OP_TRY);
+    int handler_at = lcomp_emit(k, 0);
+    lcomp_sexpr(k, x->cell[1], 0);
+    lcomp_emit(k, OP_UNTRY);
+    lcomp_emit(k, OP_JUMP);
+    int end_at = lcomp_emit(k, 0);
+
+    lval *formals = lval_add(lval_qexpr(), lval_sym("err"));
+    lval *f = lval_lambda(formals, lval_copy(x->cell[2]));
+    lval_compile(k->env, f);
+    k->code->ops[handler_at] = k->code->count;
+    lcomp_emit(k, OP_CATCH);
+    lcomp_emit(k, lcomp_const(k, f));
+    lcomp_emit(k, tail);
+    k->code->ops[end_at] = k->code->count;
+}
+
+int lcomp_symbols(lval *x) {
+    if (x->type != LVAL_QEXPR) return 0;
+    for (int i = 0; i < x->count; ++i) {
+        if (x->cell[i]->type != LVAL_SYM) return 0;
+    }
+    return 1;
+}
+
+void lcomp_lambda(lcomp *k, lval *x) {
+    lval *f = lval_lambda(lval_copy(x->cell[1]), lval_copy(x->cell[2]));
+    lval_compile(k->env, f);
+    lcomp_emit(k, OP_LAMBDA);
+    lcomp_emit(k, lcomp_const(k, f));
+}
+
+void lcomp_def(lcomp *k, lval *x) {
+    for (int i = 2; i < x->count; ++i) lcomp_expr(k, x->cell[i], 0);
+    lcomp_emit(k, OP_DEF);
+    lcomp_emit(k, lcomp_const(k, lval_copy(x->cell[1])));
+    lcomp_emit(k, x->count - 2);
+}
+
+/* Whether the template cell x expands to itself */
+int lquasi_static(lval *x, int depth) {
+    if (depth == 1 && (lquasi_form(x, "unquote") || lquasi_form(x, "unquote-splicing"))) {
+        return 0;
+    }
+    if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) return 1;
+    for (int i = 0; i < x->count; ++i) {
+        if (!lquasi_static(x->cell[i], lquasi_depth(x, depth))) return 0;
+    }
+    return 1;
+}
+
+/* A template is compiled to push the pieces of its expansion, followed by
+   an OP_QUASI that allocates the list at its final size and moves the
+   pieces into it, splicing those flagged in a constant list. A run of
+   constant cells is pushed as a single piece to splice. */
+void lcomp_quasi(lcomp *k, lval *x, int type, int depth) {
+    int dynamic = 0;
+    for (int i = 0; i < x->count; ++i) {
+        if (!lquasi_static(x->cell[i], depth)) dynamic = 1;
+    }
+    if (!dynamic) {
+        lval *v = lval_copy(x);
+        v->type = type;
+        lcomp_emit(k, OP_CONST);
+        lcomp_emit(k, lcomp_const(k, v));
+        return;
+    }
+
+    lval *flags = lval_qexpr();
+    lval *run = lval_qexpr();
+    for (int i = 0; i <= x->count; ++i) {
+        lval *y = i < x->count ? x->cell[i] : NULL;
+        if (y && lquasi_static(y, depth)) {
+            lval_add(run, lval_copy(y));
+            continue;
+        }
+        if (run->count) {
+            lcomp_emit(k, OP_CONST);
+            if (run->count == 1) {
+                lcomp_emit(k, lcomp_const(k, lval_pop(run, 0)));
+                lval_add(flags, lval_num(0));
+            } else {
+                lcomp_emit(k, lcomp_const(k, run));
+                lval_add(flags, lval_num(1));
+                run = lval_qexpr();
+            }
+        }
+        if (!y) break;
+
+        int splice = lquasi_form(y, "unquote-splicing");
+        if (depth == 1 && (splice || lquasi_form(y, "unquote"))) {
+            lcomp_expr(k, y->cell[1], 0);
+            lval_add(flags, lval_num(splice));
+        } else {
+            lcomp_quasi(k, y, y->type, lquasi_depth(y, depth));
+            lval_add(flags, lval_num(0));
+        }
+    }
+    lval_del(run);
+
+    lcomp_emit(k, OP_QUASI);
+    lcomp_emit(k, type);
+    lcomp_emit(k, flags->count);
+    lcomp_emit(k, lcomp_const(k, flags));
+}
+
+int lcomp_select_clauses(lval *x) {
+    for (int i = 1; i < x->count; ++i) {
+        if (x->cell[i]->type != LVAL_QEXPR || x->cell[i]->count < 2) return 0;
+    }
+    return 1;
+}
+
+void lcomp_select(lcomp *k, lval *x, int tail) {
+    int *ends = malloc(sizeof(int) * x->count);
+    int n = 0;
+    for (int i = 1; i < x->count; ++i) {
+        lcomp_expr(k, x->cell[i]->cell[0], 0);
+        lcomp_emit(k, OP_IF);
+        int next_at = lcomp_emit(k, 0);
+        lcomp_expr(k, x->cell[i]->cell[1], tail);
+        lcomp_emit(k, OP_JUMP);
+        ends[n++] = lcomp_emit(k, 0);
+        k->code->ops[next_at] = k->code->count;
+    }
+    lcomp_emit(k, OP_CONST);
+    lcomp_emit(k, lcomp_const(k, lval_err("No selection Found")));
+    lcomp_emit(k, OP_THROW);
+    for (int i = 0; i < n; ++i) k->code->ops[ends[i]] = k->code->count;
+    free(ends);
+}
+
+/* A match is compiled into a decision tree over a matrix of patterns, a
+   row per clause and a column per part of the value already taken apart
+   into a match register. The first refutable pattern of the first row is
+   tested: the rows the outcome decides are expanded into the parts it
+   exposes, or dropped, and the others are carried down both branches. The
+   first row left with only variables binds them and runs its clause. */
+
+/* The registers a pattern can take apart, a bound on those its tree uses */
+int lmatch_cells(lval *p) {
+    if (p->type != LVAL_QEXPR) return 0;
+    int n = p->count;
+    for (int i = 0; i < p->count; ++i) n += lmatch_cells(p->cell[i]);
+    return n;
+}
+
+int lcomp_match_clauses(lval *x) {
+    if (x->count < 2) return 0;
+    int regs = 1;
+    for (int i = 2; i < x->count; ++i) {
+        lval *c = x->cell[i];
+        if (c->type != LVAL_QEXPR || c->count != 2) return 0;
+        lval *vars = lval_sexpr();
+        lval *err = lmatch_check(c->cell[0], vars);
+        lval_del(vars);
+        if (err) {
+            lval_del(err);
+            return 0;
+        }
+        regs += lmatch_cells(c->cell[0]);
+    }
+    return regs <= LVM_MATCH;
+}
+
+typedef struct lmatch_row {
+    int clause;
+    lval *pats;
+    lval *binds;
+} lmatch_row;
+
+/* vars holds the symbols each clause binds, in the order its lambda takes
+   them; jumps the jumps to patch into each clause, then into the failure */
+typedef struct lmatch {
+    lval *vars;
+    lval *jumps;
+} lmatch;
+
+/* Whether a value matching the list or literal pattern t matches p too:
+   1 if it always does, 0 if it never does and -1 if that depends */
+int lmatch_decide(lval *t, lval *p) {
+    if (t->type != LVAL_QEXPR || p->type != LVAL_QEXPR) return lval_eq(t, p);
+
+    lval *trest, *prest;
+    int n = lmatch_list(t, &trest);
+    int m = lmatch_list(p, &prest);
+    if (!trest) return prest ? m <= n : m == n;
+    if (prest) return m <= n ? 1 : -1;
+    return m >= n ? -1 : 0;
+}
+
+/* Whether every value matching p matches t */
+int lmatch_within(lval *t, lval *p) {
+    if (t->type != LVAL_QEXPR || p->type != LVAL_QEXPR) return lval_eq(t, p);
+
+    lval *trest, *prest;
+    int n = lmatch_list(t, &trest);
+    int m = lmatch_list(p, &prest);
+    return trest ? m >= n : !prest && m == n;
+}
+
+lval *lmatch_bind_entry(lval *sym, int reg, int from) {
+    lval *b = lval_add(lval_qexpr(), lval_copy(sym));
+    lval_add(b, lval_num(reg));
+    return lval_add(b, lval_num(from));
+}
+
+void lmatch_rows_del(lmatch_row *rows, int n) {
+    for (int i = 0; i < n; ++i) {
+        lval_del(rows[i].pats);
+        lval_del(rows[i].binds);
+    }
+    free(rows);
+}
+
+/* Pushes the variables of a row in the order its clause binds them, drops
+   the value matched and jumps to the clause */
+void lcomp_match_leaf(lcomp *k, lmatch *m, lmatch_row *row, int *regs) {
+    for (int c = 0; c < row->pats->count; ++c) {
+        lval *p = row->pats->cell[c];
+        if (!lmatch_wild(p)) lval_add(row->binds, lmatch_bind_entry(p, regs[c], -1));
+    }
+
+    lval *vars = m->vars->cell[row->clause];
+    for (int i = 0; i < vars->count; ++i) {
+        for (int j = 0; j < row->binds->count; ++j) {
+            lval *b = row->binds->cell[j];
+            if (b->cell[0]->sym != vars->cell[i]->sym) continue;
+            if (b->cell[2]->num < 0) {
+                lcomp_emit(k, OP_MBIND);
+                lcomp_emit(k, b->cell[1]->num);
+            } else {
+                lcomp_emit(k, OP_MREST);
+                lcomp_emit(k, b->cell[1]->num);
+                lcomp_emit(k, b->cell[2]->num);
+            }
+            break;
+        }
+    }
+    lcomp_emit(k, OP_MDROP);
+    lcomp_emit(k, vars->count);
+    lcomp_emit(k, OP_JUMP);
+    lval_add(m->jumps->cell[row->clause], lval_num(lcomp_emit(k, 0)));
+}
+
+void lcomp_match_tree(lcomp *k, lmatch *m, lmatch_row *rows, int n,
+        int *regs, int cols, int next) {
+    if (n == 0) {
+        lcomp_emit(k, OP_JUMP);
+        lval_add(m->jumps->cell[m->jumps->count - 1], lval_num(lcomp_emit(k, 0)));
+        return;
+    }
+
+    int j = 0;
+    while (j < cols && rows[0].pats->cell[j]->type == LVAL_SYM) j++;
+    if (j == cols) {
+        lcomp_match_leaf(k, m, &rows[0], regs);
+        return;
+    }
+
+    lval *t = lval_copy(rows[0].pats->cell[j]);
+    lval *trest = NULL;
+    int width = t->type == LVAL_QEXPR ? lmatch_list(t, &trest) : 0;
+    int fail_at;
+    if (t->type == LVAL_QEXPR) {
+        lcomp_emit(k, OP_MLIST);
+        lcomp_emit(k, regs[j]);
+        lcomp_emit(k, width);
+        lcomp_emit(k, trest != NULL);
+        fail_at = lcomp_emit(k, 0);
+    } else {
+        lcomp_emit(k, OP_MEQ);
+        lcomp_emit(k, regs[j]);
+        lcomp_emit(k, lcomp_const(k, lval_copy(t)));
+        fail_at = lcomp_emit(k, 0);
+    }
+
+    /* Rows the test decides lose their pattern at column j, and list rows
+       gain one column per cell it exposes */
+    lmatch_row *yes = malloc(sizeof(lmatch_row) * n);
+    int yes_count = 0;
+    for (int i = 0; i < n; ++i) {
+        lval *p = rows[i].pats->cell[j];
+        int d = p->type == LVAL_SYM ? 1 : lmatch_decide(t, p);
+        if (d == 0) continue;
+
+        lmatch_row *row = &yes[yes_count++];
+        row->clause = rows[i].clause;
+        row->pats = lval_copy(rows[i].pats);
+        row->binds = lval_copy(rows[i].binds);
+        lval *prest = NULL;
+        int known = d == 1 && p->type == LVAL_QEXPR ? lmatch_list(p, &prest) : 0;
+        for (int c = 0; c < width; ++c) {
+            lval_add(row->pats, c < known ? lval_copy(p->cell[c]) : lval_sym("_"));
+        }
+        if (d == 1) {
+            if (p->type == LVAL_SYM && !lmatch_wild(p)) {
+                lval_add(row->binds, lmatch_bind_entry(p, regs[j], -1));
+            }
+            if (prest && !lmatch_wild(prest)) {
+                lval_add(row->binds, lmatch_bind_entry(prest, regs[j], known));
+            }
+            lval_del(row->pats->cell[j]);
+            row->pats->cell[j] = lval_sym("_");
+        }
+    }
+
+    /* Cells no row looks into are never loaded */
+    int *sub = malloc(sizeof(int) * (cols + width));
+    memcpy(sub, regs, sizeof(int) * cols);
+    int sub_cols = cols;
+    int sub_next = next;
+    for (int c = 0; c < width; ++c) {
+        int used = 0;
+        for (int i = 0; i < yes_count; ++i) {
+            used |= !lmatch_wild(yes[i].pats->cell[sub_cols]);
+        }
+        if (!used) {
+            for (int i = 0; i < yes_count; ++i) {
+                lval_del(lval_pop(yes[i].pats, sub_cols));
+            }
+            continue;
+        }
+        lcomp_emit(k, OP_MCELL);
+        lcomp_emit(k, regs[j]);
+        lcomp_emit(k, c);
+        lcomp_emit(k, sub_next);
+        sub[sub_cols++] = sub_next++;
+    }
+    lcomp_match_tree(k, m, yes, yes_count, sub, sub_cols, sub_next);
+    lmatch_rows_del(yes, yes_count);
+    free(sub);
+
+    k->code->ops[fail_at] = k->code->count;
+    lmatch_row *no = malloc(sizeof(lmatch_row) * n);
+    int no_count = 0;
+    for (int i = 0; i < n; ++i) {
+        lval *p = rows[i].pats->cell[j];
+        if (p->type != LVAL_SYM && lmatch_within(t, p)) continue;
+        no[no_count].clause = rows[i].clause;
+        no[no_count].pats = lval_copy(rows[i].pats);
+        no[no_count].binds = lval_copy(rows[i].binds);
+        no_count++;
+    }
+    lcomp_match_tree(k, m, no, no_count, regs, cols, next);
+    lmatch_rows_del(no, no_count);
+    lval_del(t);
+}
+
+/* The value matched stays on the stack until a clause is chosen. Clauses
+   that bind variables run as a lambda of them entered by OP_ENTER with
+   their values, like the body of a let; the others are compiled in place. */
+void lcomp_match(lcomp *k, lval *x, int tail) {
+    lcomp_expr(k, x->cell[1], 0);
+    lcomp_emit(k, OP_MATCH);
+
+    int clauses = x->count - 2;
+    lmatch m = { lval_sexpr(), lval_sexpr() };
+    lmatch_row *rows = malloc(sizeof(lmatch_row) * clauses);
+    for (int i = 0; i < clauses; ++i) {
+        lval *vars = lval_qexpr();
+        lmatch_check(x->cell[i + 2]->cell[0], vars);
+        lval_add(m.vars, vars);
+        lval_add(m.jumps, lval_sexpr());
+        rows[i].clause = i;
+        rows[i].pats = lval_add(lval_sexpr(), lval_copy(x->cell[i + 2]->cell[0]));
+        rows[i].binds = lval_sexpr();
+    }
+    lval_add(m.jumps, lval_sexpr());
+
+    int root = 0;
+    lcomp_match_tree(k, &m, rows, clauses, &root, 1, 1);
+    lmatch_rows_del(rows, clauses);
+
+    lval *ends = lval_sexpr();
+    for (int i = 0; i <= clauses; ++i) {
+        lval *jumps = m.jumps->cell[i];
+        if (jumps->count == 0) continue;
+        for (int j = 0; j < jumps->count; ++j) k->code->ops[jumps->cell[j]->num] = k->code->count;
+
+        if (i == clauses) {
+            lcomp_emit(k, OP_POP);
+            lcomp_emit(k, OP_CONST);
+            lcomp_emit(k, lcomp_const(k, lval_err("No pattern matched")));
+            lcomp_emit(k, OP_THROW);
+            continue;
+        }
+        lval *body = x->cell[i + 2]->cell[1];
+        lval *vars = m.vars->cell[i];
+        if (vars->count) {
+            lval *f = lval_lambda(lval_copy(vars), lval_add(lval_qexpr(), lval_copy(body)));
+            lval_compile(k->env, f);
+            lcomp_emit(k, OP_ENTER);
+            lcomp_emit(k, lcomp_const(k, f));
+            lcomp_emit(k, tail);
+        } else {
+            lcomp_expr(k, body, tail);
+        }
+        lcomp_emit(k, OP_JUMP);
+        lval_add(ends, lval_num(lcomp_emit(k, 0)));
+    }
+    for (int i = 0; i < ends->count; ++i) k->code->ops[ends->cell[i]->num] = k->code->count;
+    lval_del(ends);
+    lval_del(m.vars);
+    lval_del(m.jumps);
+}
+
+/* A while loop runs in the enclosing frame. The other loops run in a frame
+   of their own, entered once by OP_ENTER, whose slots are the loop variable
+   and the loop's state: #at and #to over a range, #list and #at for each.
+   The frame is marked as a loop's, so = in the body reaches past it.
+   OP_LOOP and OP_EACH advance the state and set the variable in place, so
+   the loop itself allocates nothing per iteration. State of the wrong type
+   is left to the builtin to report. */
+int lcomp_loop_form(lcomp *k, lval *x, lbuiltin **func) {
+    lbuiltin *loops[] = { builtin_dotimes, builtin_for_range, builtin_each };
+    int counts[] = { 4, 5, 4 };
+    for (int i = 0; i < 3; ++i) {
+        if (x->count != counts[i] || !lcomp_special(k, x->cell[0], loops[i])) continue;
+        lval *var = x->cell[1];
+        if (var->type != LVAL_QEXPR || var->count != 1 || var->cell[0]->type != LVAL_SYM ||
+                x->cell[x->count - 1]->type != LVAL_QEXPR) {
+            return 0;
+        }
+        *func = loops[i];
+        return 1;
+    }
+    return 0;
+}
+
+void lcomp_while(lcomp *k, lval *x) {
+    int top = k->code->count;
+    lcomp_sexpr(k, x->cell[1], 0);
+    lcomp_emit(k, OP_WHILE);
+    int exit_at = lcomp_emit(k, 0);
+    lcomp_sexpr(k, x->cell[2], 0);
+    lcomp_emit(k, OP_POP);
+    lcomp_emit(k, OP_JUMP);
+    lcomp_emit(k, top);
+    k->code->ops[exit_at] = k->code->count;
+    lcomp_emit(k, OP_CONST);
+    lcomp_emit(k, lcomp_const(k, lval_sexpr()));
+}
+
+void lcomp_finish(lcomp *k);
+
+void lcomp_loop(lcomp *k, lval *x, lbuiltin *func, int tail) {
+    int each = func == builtin_each;
+    lval *var = x->cell[1]->cell[0];
+    lval *body = x->cell[x->count - 1];
+    lval *formals = lval_add(lval_qexpr(), lval_copy(var));
+    lval_add(formals, lval_sym(each ? "#list" : "#at"));
+    lval_add(formals, lval_sym(each ? "#at" : "#to"));
+
+    lcomp_emit(k, OP_CONST);
+    lcomp_emit(k, lcomp_const(k, lval_num(0)));
+    if (func == builtin_dotimes) {
+        lcomp_emit(k, OP_CONST);
+        lcomp_emit(k, lcomp_const(k, lval_num(0)));
+    }
+    for (int i = 2; i < x->count - 1; ++i) lcomp_expr(k, x->cell[i], 0);
+    if (each) {
+        lcomp_emit(k, OP_CONST);
+        lcomp_emit(k, lcomp_const(k, lval_num(0)));
+    }
+
+    char *slots[] = { var->sym, formals->cell[1]->sym, formals->cell[2]->sym };
+    lcomp l = { lcode_new(), k->env, 3, slots };
+    l.code->arity = 3;
+    l.code->loop = 1;
+    int *at = malloc(sizeof(int) * 2);
+    int guards = 0;
+    for (int slot = 1; slot <= 2; ++slot) {
+        if (each && slot == 2) break;
+        lcomp_emit(&l, OP_GUARDT);
+        lcomp_emit(&l, slot);
+        lcomp_emit(&l, each ? LVAL_QEXPR : LVAL_NUM);
+        at[guards++] = lcomp_emit(&l, 0);
+    }
+    lcomp_emit(&l, OP_JUMP);
+    int test_at = lcomp_emit(&l, 0);
+    int top = l.code->count;
+    lcomp_sexpr(&l, body, 0);
+    lcomp_emit(&l, OP_POP);
+    l.code->ops[test_at] = l.code->count;
+    lcomp_emit(&l, each ? OP_EACH : OP_LOOP);
+    lcomp_emit(&l, top);
+    lcomp_emit(&l, OP_CONST);
+    lcomp_emit(&l, lcomp_const(&l, lval_sexpr()));
+    lcomp_emit(&l, OP_JUMP);
+    int end_at = lcomp_emit(&l, 0);
+
+    lcomp_patch(&l, at, guards);
+    lcomp_emit(&l, OP_CONST);
+    lcomp_emit(&l, lcomp_const(&l, lval_func(func)));
+    lcomp_emit(&l, OP_CONST);
+    lcomp_emit(&l, lcomp_const(&l, lval_copy(x->cell[1])));
+    for (int slot = func == builtin_dotimes ? 2 : 1; slot <= (each ? 1 : 2); ++slot) {
+        lcomp_emit(&l, OP_LOCAL);
+        lcomp_emit(&l, slot);
+    }
+    lcomp_emit(&l, OP_CONST);
+    lcomp_emit(&l, lcomp_const(&l, lval_copy(body)));
+    lcomp_emit(&l, OP_CALL);
+    lcomp_emit(&l, x->count);
+    l.code->ops[end_at] = l.code->count;
+    lcomp_finish(&l);
+
+    lval *f = lval_lambda(formals, lval_qexpr());
+    f->code = l.code;
+    lcomp_emit(k, OP_ENTER);
+    lcomp_emit(k, lcomp_const(k, f));
+    lcomp_emit(k, tail);
+}
+
+/* Definition-time optimizations: arithmetic over literals is folded and
+   calls to small global lambdas are inlined. Both depend on what a global
+   name is bound to when the code is compiled, so each is emitted behind
+   OP_GUARD instructions that fall back to the unoptimized code once one
+   of those names is redefined or shadowed. */
+
+int lvm_global_slot(char *sym);
+
+int lval_same_fun(lval *f, lval *g) {
+    if (f->type != LVAL_FUN) return 0;
+    if (g->builtin) return f->builtin == g->builtin && f->memo == g->memo;
+    return !f->builtin && f->code == g->code;
+}
+
+lval *lcomp_global(lcomp *k, lval *x) {
+    if (x->type != LVAL_SYM || lcomp_slot(k, x->sym) >= 0) return NULL;
+    int slot = lvm_global_slot(x->sym);
+    return slot < 0 ? NULL : lroot->vals[slot];
+}
+
+/* Emits a guard on the current binding of sym and returns the position
+   of its jump target */
+int lcomp_guard(lcomp *k, lval *sym) {
+    lcomp_emit(k, OP_GUARD);
+    lcomp_emit(k, lcomp_const(k, lval_copy(sym)));
+    lcomp_emit(k, lcomp_const(k, lval_copy(lcomp_global(k, sym))));
+    lcomp_emit(k, lvm_global_slot(sym->sym));
+    return lcomp_emit(k, 0);
+}
+
+void lcomp_dep(lval *deps, lval *sym) {
+    for (int i = 0; i < deps->count; ++i) {
+        if (deps->cell[i]->sym == sym->sym) return;
+    }
+    lval_add(deps, lval_copy(sym));
+}
+
+int lcomp_arith(lbuiltin *func);
+
+/* Evaluates x if it applies arithmetic builtins to number literals,
+   adding the names of the builtins it relies on to deps */
+lval *lcomp_fold(lcomp *k, lval *x, lval *deps) {
+    if (x->type == LVAL_NUM) return lval_copy(x);
+    if (x->type != LVAL_SEXPR || x->count < 2) return NULL;
+
+    lval *f = lcomp_global(k, x->cell[0]);
+    if (!f || f->type != LVAL_FUN || !lcomp_arith(f->builtin)) return NULL;
+
+    lval *args = lval_sexpr();
+    for (int i = 1; i < x->count; ++i) {
+        lval *y = lcomp_fold(k, x->cell[i], deps);
+        if (!y) {
+            lval_del(args);
+            return NULL;
+        }
+        lval_add(args, y);
+    }
+
+    lval *v = f->builtin(lroot, args);
+    if (v->type != LVAL_NUM) {
+        lval_del(v);
+        return NULL;
+    }
+    lcomp_dep(deps, x->cell[0]);
+    return v;
+}
+
+/* Emits the guards in deps; their targets are patched with lcomp_patch */
+int *lcomp_guards(lcomp *k, lval *deps) {
+    int *at = malloc(sizeof(int) * deps->count);
+    for (int i = 0; i < deps->count; ++i) at[i] = lcomp_guard(k, deps->cell[i]);
+    return at;
+}
+
+/* Emits a guard that each local in slots holds a number */
+int *lcomp_type_guards(lcomp *k, lval *slots) {
+    int *at = malloc(sizeof(int) * slots->count);
+    for (int i = 0; i < slots->count; ++i) {
+        lcomp_emit(k, OP_GUARDT);
+        lcomp_emit(k, slots->cell[i]->num);
+        lcomp_emit(k, LVAL_NUM);
+        at[i] = lcomp_emit(k, 0);
+    }
+    return at;
+}
+
+/* Arithmetic over number literals and locals is typed statically: it
+   always gives a number while the builtins it calls, added to deps, keep
+   their bindings and the locals it reads, added to slots, hold numbers.
+   Its result goes to lvm_nums[depth], above which it needs room to work. */
+int lcomp_typed(lcomp *k, lval *x, lval *deps, lval *slots, int depth) {
+    if (depth >= LVM_NUMS) return 0;
+    if (x->type == LVAL_NUM) return 1;
+    if (x->type == LVAL_SYM) {
+        int slot = lcomp_slot(k, x->sym);
+        if (slot < 0) return 0;
+        for (int i = 0; i < slots->count; ++i) {
+            if (slots->cell[i]->num == slot) return 1;
+        }
+        lval_add(slots, lval_num(slot));
+        return 1;
+    }
+    if (x->type != LVAL_SEXPR || x->count < 2) return 0;
+
+    lval *f = lcomp_global(k, x->cell[0]);
+    int op = f && f->type == LVAL_FUN ? lcomp_arith(f->builtin) : 0;
+    if (!op || (op >= OP_EQ2 && x->count != 3)) return 0;
+    int unary = x->count == 2 && op == OP_SUB2;
+    for (int i = 1; i < x->count; ++i) {
+        int d = depth + (i > 1 || unary);
+        if (!lcomp_typed(k, x->cell[i], deps, slots, d)) return 0;
+    }
+    lcomp_dep(deps, x->cell[0]);
+    return 1;
+}
+
+void lcomp_typed_op(lcomp *k, int op, int depth) {
+    lcomp_emit(k, OP_NARITH);
+    lcomp_emit(k, op);
+    lcomp_emit(k, depth);
+}
+
+/* Emits typed arithmetic as unchecked instructions on unboxed numbers,
+   folding the operands from the left the way the builtins do */
+void lcomp_typed_emit(lcomp *k, lval *x, int depth) {
+    if (x->type == LVAL_NUM || x->type == LVAL_SYM) {
+        int num = x->type == LVAL_NUM;
+        lcomp_emit(k, num ? OP_NCONST : OP_NLOCAL);
+        lcomp_emit(k, depth);
+        lcomp_emit(k, num ? lcomp_const(k, lval_copy(x)) : lcomp_slot(k, x->sym));
+        return;
+    }
+    int op = lcomp_arith(lcomp_global(k, x->cell[0])->builtin);
+    if (x->count == 2 && op == OP_SUB2) {
+        lval *zero = lval_num(0);
+        lcomp_typed_emit(k, zero, depth);
+        lval_del(zero);
+        lcomp_typed_emit(k, x->cell[1], depth + 1);
+        lcomp_typed_op(k, op, depth + 1);
+        return;
+    }
+    lcomp_typed_emit(k, x->cell[1], depth);
+    for (int i = 2; i < x->count; ++i) {
+        lcomp_typed_emit(k, x->cell[i], depth + 1);
+        lcomp_typed_op(k, op, depth + 1);
+    }
+}
+
+void lcomp_patch(lcomp *k, int *at, int n) {
+    for (int i = 0; i < n; ++i) k->code->ops[at[i]] = k->code->count;
+    free(at);
+}
+
+int lval_mentions(lval *x, char *sym) {
+    if (x->type == LVAL_SYM) return x->sym == sym;
+    if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) return 0;
+    for (int i = 0; i < x->count; ++i) {
+        if (lval_mentions(x->cell[i], sym)) return 1;
+    }
+    return 0;
+}
+
+lval *builtin_len(lenv *e, lval *a);
+lval *builtin_take(lenv *e, lval *a);
+lval *builtin_drop(lenv *e, lval *a);
+
+/* The builtins an inlined body may call. None of them evaluates a
+   Q-Expression, calls a function it is passed or binds a name, so none
+   can tell that the callee's frame is gone. Those taking a callback, such
+   as map, filter, foldl, sum, apply and unpack, call it with the caller's
+   frame as its dynamic scope, so they must never be added here. */
+lbuiltin *lcomp_pure[] = {
+    builtin_add, builtin_sub, builtin_mul, builtin_div, builtin_mod,
+    builtin_min, builtin_max, builtin_abs,
+    builtin_gt, builtin_lt, builtin_ge, builtin_le, builtin_eq, builtin_ne,
+    builtin_list, builtin_head, builtin_tail, builtin_join, builtin_len,
+    builtin_take, builtin_drop,
+};
+
+int lcomp_pure_builtin(lbuiltin *func) {
+    for (unsigned i = 0; i < sizeof(lcomp_pure) / sizeof(lcomp_pure[0]); ++i) {
+        if (lcomp_pure[i] == func) return 1;
+    }
+    return 0;
+}
+
+int lcomp_inlinable(lcomp *k, lval *x, lval *formals, lval *deps, int *size);
+
+/* A Q-Expression if will evaluate is checked as the code it runs */
+int lcomp_inlinable_branch(lcomp *k, lval *x, lval *formals, lval *deps, int *size) {
+    for (int i = 0; i < formals->count; ++i) {
+        if (lval_mentions(x, formals->cell[i]->sym)) return 0;
+    }
+    if (x->count == 1 && x->cell[0]->type != LVAL_SEXPR) return 1;
+    lval code = *x;
+    code.type = LVAL_SEXPR;
+    return lcomp_inlinable(k, &code, formals, deps, size);
+}
+
+/* A body can be inlined if it is small, only calls the builtins above or
+   an if with literal branches, and does not mention its formals inside
+   Q-Expressions, where they could not be substituted. Anything else could
+   run code that looks the callee's formals up through dynamic scope, or =
+   could bind a name in the caller's frame instead of the callee's. */
+int lcomp_inlinable(lcomp *k, lval *x, lval *formals, lval *deps, int *size) {
+    if (++*size > 16) return 0;
+    if (x->type == LVAL_QEXPR) {
+        for (int i = 0; i < formals->count; ++i) {
+            if (lval_mentions(x, formals->cell[i]->sym)) return 0;
+        }
+        return 1;
+    }
+    if (x->type != LVAL_SEXPR) return 1;
+    if (x->count == 0) return 1;
+
+    lval *head = x->cell[0];
+    for (int i = 0; i < formals->count; ++i) {
+        if (lval_mentions(head, formals->cell[i]->sym)) return 0;
+    }
+    lval *f = lcomp_global(k, head);
+    if (!f || f->type != LVAL_FUN || !f->builtin || f->memo) return 0;
+    if (f->builtin == builtin_if) {
+        if (x->count != 4 || x->cell[2]->type != LVAL_QEXPR ||
+                x->cell[3]->type != LVAL_QEXPR) {
+            return 0;
+        }
+        lcomp_dep(deps, head);
+        return lcomp_inlinable(k, x->cell[1], formals, deps, size) &&
+            lcomp_inlinable_branch(k, x->cell[2], formals, deps, size) &&
+            lcomp_inlinable_branch(k, x->cell[3], formals, deps, size);
+    }
+    if (!lcomp_pure_builtin(f->builtin)) return 0;
+    lcomp_dep(deps, head);
+
+    for (int i = 1; i < x->count; ++i) {
+        if (!lcomp_inlinable(k, x->cell[i], formals, deps, size)) return 0;
+    }
+    return 1;
+}
+
+void lcomp_subst(lval *x, lval *formals, lval *args) {
+    for (int i = 0; i < x->count; ++i) {
+        lval *y = x->cell[i];
+        if (y->type == LVAL_SEXPR) {
+            lcomp_subst(y, formals, args);
+            continue;
+        }
+        if (y->type != LVAL_SYM) continue;
+        for (int j = 0; j < formals->count; ++j) {
+            if (formals->cell[j]->sym == y->sym) {
+                x->cell[i] = lval_copy(args->cell[j + 1]);
+                lval_del(y);
+                break;
+            }
+        }
+    }
+}
+
+/* Otherwise, the free names of an inlined body resolve in the caller
+   exactly as they did in the callee's frame, so a call is replaced by the
+   body with its formals substituted. Arguments must be literals or locals,
+   whose evaluation can neither fail nor be observed. A body can still
+   reach calls through the lambdas it compiles, so recursive functions are
+   never inlined and inlining stops at a fixed depth. */
+#define LCOMP_INLINE_DEPTH 4
+int lcomp_inline_depth = 0;
+
+lval *lcomp_inline_body(lcomp *k, lval *x, lval *deps) {
+    lval *f = lcomp_global(k, x->cell[0]);
+    if (!f || f->type != LVAL_FUN || f->builtin || !f->code || f->ns ||
+            f->env->count || f->formals->count != x->count - 1 ||
+            lcomp_inline_depth >= LCOMP_INLINE_DEPTH ||
+            lval_mentions(f->body, x->cell[0]->sym)) {
+        return NULL;
+    }
+    for (int i = 0; i < f->formals->count; ++i) {
+        if (strcmp(f->formals->cell[i]->sym, "&") == 0) return NULL;
+    }
+    for (int i = 1; i < x->count; ++i) {
+        lval *y = x->cell[i];
+        if (y->type == LVAL_SYM ? lcomp_slot(k, y->sym) < 0 :
+                y->type == LVAL_SEXPR || y->type == LVAL_ERR) {
+            return NULL;
+        }
+    }
+
+    lval *body = lval_copy(f->body);
+    body->type = LVAL_SEXPR;
+    int size = 0;
+    lcomp_dep(deps, x->cell[0]);
+    if (!lcomp_inlinable(k, body, f->formals, deps, &size)) {
+        lval_del(body);
+        return NULL;
+    }
+    lcomp_subst(body, f->formals, x);
+    return body;
+}
+
+/* A condition that folds to a constant compiles only the branch taken */
+void lcomp_if(lcomp *k, lval *x, int tail) {
+    lval *deps = lval_sexpr();
+    lval *c = lcomp_fold(k, x->cell[1], deps);
+    if (!c) {
+        lval_del(deps);
+        lcomp_branch(k, x, tail);
+        return;
+    }
+
+    int *at = lcomp_guards(k, deps);
+    lcomp_sexpr(k, x->cell[c->num ? 2 : 3], tail);
+    if (deps->count) {
+        lcomp_emit(k, OP_JUMP);
+        int end = lcomp_emit(k, 0);
+        lcomp_patch(k, at, deps->count);
+        lcomp_branch(k, x, tail);
+        k->code->ops[end] = k->code->count;
+    } else {
+        free(at);
+    }
+    lval_del(c);
+    lval_del(deps);
+}
+
+void lcomp_call(lcomp *k, lval *x, int tail) {
+    lval *head = x->cell[0];
+    if (head->type == LVAL_SYM && lcomp_slot(k, head->sym) < 0) {
+        for (int i = 1; i < x->count; ++i) lcomp_expr(k, x->cell[i], 0);
+        lcomp_emit(k, tail ? OP_TAILCALLG : OP_CALLG);
+        lcomp_emit(k, lcomp_const(k, lval_copy(head)));
+        lcomp_emit(k, x->count - 1);
+        lcomp_emit(k, 0);
+        return;
+    }
+
+    for (int i = 0; i < x->count; ++i) lcomp_expr(k, x->cell[i], 0);
+    lcomp_emit(k, tail ? OP_TAILCALL : OP_CALL);
+    lcomp_emit(k, x->count);
+}
+
+/* Macros are expanded where their call is compiled, so each call site pays
+   for its expansion once. The macro is applied to its operands unevaluated
+   and its result is compiled in place of the call, a Q-Expression as code. */
+int lcomp_macro(lcomp *k, lval *x, int tail) {
+    lval *head = x->cell[0];
+    if (head->type != LVAL_SYM || lcomp_slot(k, head->sym) >= 0) return 0;
+    lval *m = lenv_lookup(k->env, head->sym);
+    if (!m || m->type != LVAL_FUN || !m->macro) return 0;
+
+    lval *f = lval_copy(m);
+    f->macro = 0;
+    lval *names = lval_sexpr();
+    lmacro_rename(f->body, names);
+    if (names->count && f->code) {
+        lcode_release(f->code);
+        f->code = NULL;
+    }
+    lval_del(names);
+    lval *args = lval_sexpr();
+    for (int i = 1; i < x->count; ++i) lval_add(args, lval_copy(x->cell[i]));
+    lval *v = lval_call(k->env, f, args);
+    lval_del(f);
+
+    if (v->type == LVAL_QEXPR) {
+        lcomp_sexpr(k, v, tail);
+    } else {
+        lcomp_expr(k, v, tail);
+    }
+    lval_del(v);
+    return 1;
+}
+
+/* Compiles the cells of x as if x were an S-Expression, whatever its type */
+void lcomp_sexpr(lcomp *k, lval *x, int tail) {
+    if (x->count == 0) {
+        lcomp_emit(k, OP_CONST);
+        lcomp_emit(k, lcomp_const(k, lval_sexpr()));
+        return;
+    }
+    if (x->count == 1) {
+        lcomp_expr(k, x->cell[0], tail);
+        return;
+    }
+
+    lval *head = x->cell[0];
+    if (lcomp_macro(k, x, tail)) return;
+    if (x->count == 4 && lcomp_special(k, head, builtin_if) &&
+            x->cell[2]->type == LVAL_QEXPR && x->cell[3]->type == LVAL_QEXPR) {
+        lcomp_if(k, x, tail);
+        return;
+    }
+    if (lcomp_special(k, head, builtin_do)) {
+        lcomp_do(k, x, tail);
+        return;
+    }
+    if (x->count == 2 && lcomp_special(k, head, builtin_quasiquote) &&
+            x->cell[1]->type == LVAL_QEXPR) {
+        lcomp_quasi(k, x->cell[1], LVAL_QEXPR, 1);
+        return;
+    }
+    if (lcomp_special(k, head, builtin_select) && lcomp_select_clauses(x)) {
+        lcomp_select(k, x, tail);
+        return;
+    }
+    if (lcomp_special(k, head, builtin_match) && lcomp_match_clauses(x)) {
+        lcomp_match(k, x, tail);
+        return;
+    }
+    lbuiltin *loop;
+    if (x->count == 3 && lcomp_special(k, head, builtin_while) &&
+            x->cell[1]->type == LVAL_QEXPR && x->cell[2]->type == LVAL_QEXPR) {
+        lcomp_while(k, x);
+        return;
+    }
+    if (lcomp_loop_form(k, x, &loop)) {
+        lcomp_loop(k, x, loop, tail);
+        return;
+    }
+    if (lcomp_special(k, head, builtin_and)) {
+        lcomp_logic(k, x, OP_AND, tail);
+        return;
+    }
+    if (lcomp_special(k, head, builtin_or)) {
+        lcomp_logic(k, x, OP_OR, tail);
+        return;
+    }
+    if (x->count == 2 && lcomp_special(k, head, builtin_yield)) {
+        lcomp_expr(k, x->cell[1], 0);
+        lcomp_emit(k, OP_YIELD);
+        return;
+    }
+    if (x->count == 3 && lcomp_special(k, head, builtin_try) &&
+            x->cell[1]->type == LVAL_QEXPR && x->cell[2]->type == LVAL_QEXPR) {
+        lcomp_try(k, x, tail);
+        return;
+    }
+    if (x->count == 2 && lcomp_special(k, head, builtin_let) &&
+            x->cell[1]->type == LVAL_QEXPR) {
+        lcomp_let(k, x, tail);
+        return;
+    }
+    if (x->count == 3 && lcomp_special(k, head, builtin_lambda) &&
+            lcomp_symbols(x->cell[1]) && x->cell[2]->type == LVAL_QEXPR) {
+        lcomp_lambda(k, x);
+        return;
+    }
+    if (lcomp_special(k, head, builtin_def) && lcomp_symbols(x->cell[1]) &&
+            x->cell[1]->count == x->count - 2) {
+        lcomp_def(k, x);
+        return;
+    }
+
+    int end = -1;
+    lval *deps = lval_sexpr();
+    lval *slots = lval_sexpr();
+    lval *v = lcomp_fold(k, x, deps);
+    int typed = 0;
+    lval *body = NULL;
+    if (!v) {
+        lval_del(deps);
+        deps = lval_sexpr();
+        typed = lcomp_typed(k, x, deps, slots, 0);
+    }
+    if (!v && !typed) {
+        lval_del(deps);
+        lval_del(slots);
+        deps = lval_sexpr();
+        slots = lval_sexpr();
+        body = lcomp_inline_body(k, x, deps);
+    }
+    if (v || typed || body) {
+        int *at = lcomp_guards(k, deps);
+        int *types = lcomp_type_guards(k, slots);
+        if (v) {
+            lcomp_emit(k, OP_CONST);
+            lcomp_emit(k, lcomp_const(k, v));
+        } else if (typed) {
+            lcomp_typed_emit(k, x, 0);
+            lcomp_emit(k, OP_NBOX);
+        } else {
+            lcomp_inline_depth++;
+            lcomp_sexpr(k, body, tail);
+            lcomp_inline_depth--;
+            lval_del(body);
+        }
+        lcomp_emit(k, OP_JUMP);
+        end = lcomp_emit(k, 0);
+        lcomp_patch(k, at, deps->count);
+        lcomp_patch(k, types, slots->count);
+    }
+    lval_del(deps);
+    lval_del(slots);
+
+    lcomp_call(k, x, tail);
+    if (end >= 0) k->code->ops[end] = k->code->count;
+}
+
+void lcomp_finish(lcomp *k) {
+    lcode *c = k->code;
+    lcomp_emit(k, OP_RET);
+    c->base_ops = malloc(sizeof(int) * c->count);
+    memcpy(c->base_ops, c->ops, sizeof(int) * c->count);
+}
+
+lcode *lval_compile_expr(lenv *e, lval *x) {
+    lcomp k = { lcode_new(), e, 0, NULL };
+    lcomp_expr(&k, x, 1);
+    lcomp_finish(&k);
+    return k.code;
+}
+
+lcode *lval_compile_sexpr(lenv *e, lval *x) {
+    lcomp k = { lcode_new(), e, 0, NULL };
+    lcomp_sexpr(&k, x, 1);
+    lcomp_finish(&k);
+    return k.code;
+}
+
+lcode *lval_compile(lenv *e, lval *f) {
+    if (f->code) return f->code;
+
+    lcomp k = { lcode_new(), e, 0, NULL };
+
+    /* Arguments are bound in order, so each formal owns a fixed env slot */
+    k.slots = malloc(sizeof(char*) * (f->env->count + f->formals->count));
+    for (int i = 0; i < f->env->count; ++i) {
+        k.slots[k.slots_count++] = f->env->syms[i];
+    }
+    for (int i = 0; i < f->formals->count; ++i) {
+        char *sym = f->formals->cell[i]->sym;
+        if (strcmp(sym, "&") == 0) {
+            k.code->variadic = 1;
+            continue;
+        }
+        if (lcomp_slot(&k, sym) >= 0) {
+            k.slots_count = 0;
+            break;
+        }
+        k.slots[k.slots_count++] = sym;
+    }
+    if (!f->env->count && !k.code->variadic && k.slots_count == f->formals->count) {
+        k.code->arity = k.slots_count;
+    }
+
+    lcomp_sexpr(&k, f->body, 1);
+    lcomp_finish(&k);
+    free(k.slots);
+
+    f->code = k.code;
+    return f->code;
+}
+
+void lvm_push(lval *v) {
+    if (vm.sp == vm.stack_size) {
+        vm.stack_size = vm.stack_size ? vm.stack_size * 2 : 256;
+        vm.stack = realloc(vm.stack, sizeof(lval*) * vm.stack_size);
+    }
+    vm.stack[vm.sp++] = v;
+}
+
+void lvm_push_frame(lcode *c, lenv *e, int owns_env) {
+    if (vm.fp == vm.frames_size) {
+        vm.frames_size = vm.frames_size ? vm.frames_size * 2 : 64;
+        vm.frames = realloc(vm.frames, sizeof(lframe) * vm.frames_size);
+    }
+    lframe *fr = &vm.frames[vm.fp++];
+    c->refs++;
+    fr->code = c;
+    fr->pc = 0;
+    fr->env = e;
+    fr->owns_env = owns_env;
+    fr->base = vm.sp;
+}
+
+lval *lvm_args(int n) {
+    lval *a = lval_sexpr();
+    a->count = n;
+    a->cell = malloc(sizeof(lval*) * n);
+    memcpy(a->cell, &vm.stack[vm.sp - n], sizeof(lval*) * n);
+    vm.sp -= n;
+    return a;
+}
+
+int lenv_shadows(lenv *e, lenv *old) {
+    for (int i = 0; i < old->count; ++i) {
+        if (lenv_find(e, old->syms[i]) < 0) return 0;
+    }
+    return 1;
+}
+
+void lvm_pop_frame(void) {
+    lframe *fr = &vm.frames[--vm.fp];
+    lenv *e = fr->env;
+    for (int i = 0; i < fr->owns_env; ++i) {
+        lenv *par = e->par;
+        lenv_del(e);
+        e = par;
+    }
+    lcode_release(fr->code);
+}
+
+/* Errors are raised rather than passed along as values: the error on top
+   of the stack unwinds to the innermost try of the run started at frame
+   base, which gets the message, or out of the run, whose result it is */
+lval *lvm_unwind(int base) {
+    lval *x = vm.stack[--vm.sp];
+    ltry *t = vm.tries_count ? &vm.tries[vm.tries_count - 1] : NULL;
+    if (t && t->fp > base) {
+        vm.tries_count--;
+        while (vm.fp > t->fp) lvm_pop_frame();
+        while (vm.sp > t->sp) lval_del(vm.stack[--vm.sp]);
+        vm.frames[vm.fp - 1].pc = t->pc;
+        lvm_push(lval_str(x->err));
+        lval_del(x);
+        return NULL;
+    }
+
+    int sp = vm.frames[base].base;
+    while (vm.fp > base) lvm_pop_frame();
+    while (vm.sp > sp) lval_del(vm.stack[--vm.sp]);
+    return x;
+}
+
+void lvm_push_try(int pc) {
+    if (vm.tries_count == vm.tries_size) {
+        vm.tries_size = vm.tries_size ? vm.tries_size * 2 : 16;
+        vm.tries = realloc(vm.tries, sizeof(ltry) * vm.tries_size);
+    }
+    vm.tries[vm.tries_count++] = (ltry){ vm.fp, vm.sp, pc };
+}
+
+/* A tail call replaces the running frame. The caller's envs are dropped
+   only while the callee binds every name in them, so dynamic scope is
+   unchanged; the rest stay reachable from the new env and die with it.
+   A loop's scope keeps them all, since = in its body binds in the env
+   around it. */
+void lvm_replace_frame(lcode *c, lenv *fe) {
+    lframe *fr = &vm.frames[vm.fp - 1];
+    lenv *old = fr->env;
+    while (!fe->loop && fr->owns_env && (!old->ns || old->ns == fe->ns) && lenv_shadows(fe, old)) {
+        lenv *par = old->par;
+        lenv_del(old);
+        old = par;
+        fr->owns_env--;
+    }
+    fe->par = old;
+    fr->owns_env++;
+    c->refs++;
+    lcode_release(fr->code);
+    fr->code = c;
+    fr->env = fe;
+    fr->pc = 0;
+}
+
+/* Moves the top n stack values into a new env as the formals of f */
+lenv *lvm_bind_fixed(lval *f, int n) {
+    lenv *fe = lenv_new();
+    fe->ns = f->ns;
+    fe->count = n;
+    fe->syms = malloc(sizeof(char*) * n);
+    fe->vals = malloc(sizeof(lval*) * n);
+    vm.sp -= n;
+    memcpy(fe->vals, &vm.stack[vm.sp], sizeof(lval*) * n);
+    for (int i = 0; i < n; ++i) {
+        fe->syms[i] = f->formals->cell[i]->sym;
+        lsym_get(fe->syms[i])->shadows++;
+    }
+    return fe;
+}
+
+/* Binds the top n stack values to the formals of f in a fresh env, the
+   way lval_call does. Returns NULL with *err unset for a partial call. */
+lenv *lvm_bind(lval *f, int n, lval **err) {
+    if (f->code && f->code->arity == n && !f->env->count) return lvm_bind_fixed(f, n);
+
+    lval *formals = f->formals;
+    int fixed = 0;
+    while (fixed < formals->count && strcmp(formals->cell[fixed]->sym, "&") != 0) fixed++;
+    int variadic = fixed < formals->count;
+
+    if (variadic && formals->count != fixed + 2) {
+        *err = lval_err("Function format invalid. "
+                "Symbols '&' not followed by single symbol.");
+        return NULL;
+    }
+    if (!variadic && n > fixed) {
+        *err = lval_err("Function passed too many arguments. "
+                "Got %i, Expected %i", n, fixed);
+        return NULL;
+    }
+    if (n < fixed) return NULL;
+
+    lenv *fe = f->env->count ? lenv_copy(f->env) : lenv_new();
+    fe->ns = f->ns;
+
+    int first = vm.sp - n;
+    for (int i = 0; i < fixed; ++i) {
+        lenv_put(fe, formals->cell[i], vm.stack[first + i]);
+        lval_del(vm.stack[first + i]);
+    }
+    if (variadic) {
+        lval *rest = lval_qexpr();
+        rest->count = n - fixed;
+        rest->cell = malloc(sizeof(lval*) * rest->count);
+        memcpy(rest->cell, &vm.stack[first + fixed], sizeof(lval*) * rest->count);
+        lenv_put(fe, formals->cell[fixed + 1], rest);
+        lval_del(rest);
+    }
+    vm.sp = first;
+    return fe;
+}
+
+/* Runs c as a new frame over e, or in place of the running frame for a
+   tail call. Non-owned envs belong to the caller and are never dropped. */
+int lvm_enter(lcode *c, lenv *e, int owns_env, int tail) {
+    if (--lfuel < 0) {
+        lval *err = lfuel_refill();
+        if (err) {
+            if (owns_env) lenv_del(e);
+            lvm_push(err);
+            return 0;
+        }
+    }
+#ifdef LJIT
+    ljit_count(c);
+#endif
+    if (tail) {
+        lframe *fr = &vm.frames[vm.fp - 1];
+        if (owns_env) {
+            lvm_replace_frame(c, e);
+        } else if (e == fr->env) {
+            c->refs++;
+            lcode_release(fr->code);
+            fr->code = c;
+            fr->pc = 0;
+        } else {
+            tail = 0;
+        }
+    }
+    if (tail) return 1;
+
+    if (vm.fp >= lvm_frames_max) {
+        if (owns_env) lenv_del(e);
+        lvm_push(lval_err("stack limit exceeded"));
+        return 0;
+    }
+    lvm_push_frame(c, e, owns_env);
+    return 1;
+}
+
+/* eval and if called from compiled code run their Q-Expression as a frame
+   of its own rather than re-entering the evaluator through C. Returns -1
+   for any other call, which is left on the stack; otherwise the arguments
+   are consumed and the result is that of lvm_enter. */
+int lvm_inline(lenv *e, lval *f, int n, int tail) {
+    lval **args = &vm.stack[vm.sp - n];
+    lval *body;
+    if (f->builtin == builtin_eval && n == 1 && args[0]->type == LVAL_QEXPR) {
+        body = args[0];
+    } else if (f->builtin == builtin_if && n == 3 && args[0]->type == LVAL_NUM &&
+            args[1]->type == LVAL_QEXPR && args[2]->type == LVAL_QEXPR) {
+        body = args[0]->num ? args[1] : args[2];
+    } else {
+        return -1;
+    }
+
+    lcode *c = lval_compile_sexpr(e, body);
+    while (n--) lval_del(vm.stack[--vm.sp]);
+    int entered = lvm_enter(c, e, 0, tail);
+    lcode_release(c);
+    return entered;
+}
+
+/* Fixed-arity entry points for the builtins that list code calls most.
+   They take their arguments in place on the stack, and return NULL to
+   leave any other case, errors included, to the builtin itself. */
+lval *lvm_head(lval **args) {
+    lval *x = args[0];
+    if (x->type != LVAL_QEXPR || x->count == 0) return NULL;
+    for (int i = 1; i < x->count; ++i) lval_del(x->cell[i]);
+    x->count = 1;
+    return x;
+}
+
+lval *lvm_tail(lval **args) {
+    lval *x = args[0];
+    if (x->type != LVAL_QEXPR || x->count == 0) return NULL;
+    lval_del(x->cell[0]);
+    memmove(&x->cell[0], &x->cell[1], sizeof(lval*) * --x->count);
+    return x;
+}
+
+lval *lvm_eq(lval **args) {
+    lval *x = lval_num(lval_eq(args[0], args[1]));
+    lval_del(args[0]);
+    lval_del(args[1]);
+    return x;
+}
+
+lval *lvm_ne(lval **args) {
+    lval *x = lvm_eq(args);
+    x->num = !x->num;
+    return x;
+}
+
+struct {
+    lbuiltin *func;
+    int arity;
+    lval *(*fixed)(lval**);
+} lvm_fixed_ops[] = {
+    { builtin_head, 1, lvm_head }, { builtin_tail, 1, lvm_tail },
+    { builtin_eq, 2, lvm_eq }, { builtin_ne, 2, lvm_ne },
+};
+
+int lvm_fixed(lbuiltin *func, int n) {
+    for (unsigned i = 0; i < sizeof(lvm_fixed_ops) / sizeof(lvm_fixed_ops[0]); ++i) {
+        if (lvm_fixed_ops[i].func != func) continue;
+        if (lvm_fixed_ops[i].arity != n) return 0;
+        lval *x = lvm_fixed_ops[i].fixed(&vm.stack[vm.sp - n]);
+        if (!x) return 0;
+        vm.sp -= n;
+        lvm_push(x);
+        return 1;
+    }
+    return 0;
+}
+
+/* Calls f with the top n stack values as arguments. Lambdas get a new VM
+   frame, or take over the current one for a tail call, and 1 is returned;
+   anything else leaves its result on the stack. A borrowed f is copied
+   before lval_call gets to consume it. */
+int lvm_invoke(lenv *e, lval *f, int owned, int n, int tail) {
+    if (f->builtin) {
+        int entered = lvm_inline(e, f, n, tail);
+        if (entered < 0) {
+            entered = 0;
+            if (!lvm_fixed(f->builtin, n)) lvm_push(lval_call(e, f, lvm_args(n)));
+        }
+        if (owned) lval_del(f);
+        return entered;
+    }
+
+    if (f->macro) {
+        while (n--) lval_del(vm.stack[--vm.sp]);
+        lvm_push(lval_err("Macro called before it was defined"));
+        if (owned) lval_del(f);
+        return 0;
+    }
+
+    lcode *c = lval_compile(e, f);
+    lval *err = NULL;
+    lenv *fe = lvm_bind(f, n, &err);
+    if (fe) {
+        fe->par = e;
+        int entered = lvm_enter(c, fe, 1, tail);
+        if (owned) lval_del(f);
+        return entered;
+    }
+    if (err) {
+        while (n--) lval_del(vm.stack[--vm.sp]);
+        lvm_push(err);
+        if (owned) lval_del(f);
+        return 0;
+    }
+
+    if (!owned) f = lval_copy(f);
+    lvm_push(lval_call(e, f, lvm_args(n)));
+    lval_del(f);
+    return 0;
+}
+
+int lvm_global_slot(char *sym) {
+    if (!lroot || lsym_get(sym)->shadows) return -1;
+    return lenv_find(lroot, sym);
+}
+
+struct {
+    lbuiltin *func;
+    int op;
+} lvm_arith_ops[] = {
+    { builtin_add, OP_ADD2 }, { builtin_sub, OP_SUB2 },
+    { builtin_mul, OP_MUL2 }, { builtin_div, OP_DIV2 },
+    { builtin_mod, OP_MOD2 },
+    { builtin_eq, OP_EQ2 }, { builtin_ne, OP_NE2 },
+    { builtin_lt, OP_LT2 }, { builtin_gt, OP_GT2 },
+    { builtin_le, OP_LE2 }, { builtin_ge, OP_GE2 },
+};
+
+int lvm_arith_count = sizeof(lvm_arith_ops) / sizeof(lvm_arith_ops[0]);
+
+/* Returns the instruction for an arithmetic builtin, or 0 */
+int lcomp_arith(lbuiltin *func) {
+    for (int i = 0; i < lvm_arith_count; ++i) {
+        if (lvm_arith_ops[i].func == func) return lvm_arith_ops[i].op;
+    }
+    return 0;
+}
+
+/* Specializes the global call at ops[at] on its first execution: a binary
+   arithmetic builtin applied to two numbers gets its own instruction, any
+   other callee bound globally is cached by env slot */
+void lvm_quicken_call(lcode *c, int at) {
+    lval *sym = c->consts[c->ops[at + 1]];
+    int n = c->ops[at + 2];
+    int slot = lvm_global_slot(sym->sym);
+    if (slot < 0) return;
+
+    lval *f = lroot->vals[slot];
+    int op = c->ops[at] == OP_TAILCALLG ? OP_TAILCALLG_GLOBAL : OP_CALLG_GLOBAL;
+    if (f->type == LVAL_FUN && f->builtin && n == 2 &&
+            vm.stack[vm.sp - 1]->type == LVAL_NUM &&
+            vm.stack[vm.sp - 2]->type == LVAL_NUM) {
+        for (int i = 0; i < lvm_arith_count; ++i) {
+            if (lvm_arith_ops[i].func == f->builtin) op = lvm_arith_ops[i].op;
+        }
+    }
+    c->ops[at] = op;
+    c->ops[at + 3] = slot;
+}
+
+/* Runs a quickened arithmetic instruction; returns 0 if its guard fails */
+int lvm_arith(lcode *c, int at) {
+    int op = c->ops[at];
+    lval *sym = c->consts[c->ops[at + 1]];
+    lval *f = lroot->vals[c->ops[at + 3]];
+    if (lsym_get(sym->sym)->shadows || f->type != LVAL_FUN ||
+            f->builtin != lvm_arith_ops[op - OP_ADD2].func) {
+        c->ops[at] = c->base_ops[at];
+        return 0;
+    }
+
+    lval *x = vm.stack[vm.sp - 2];
+    lval *y = vm.stack[vm.sp - 1];
+    long r;
+    if (x->type != LVAL_NUM || y->type != LVAL_NUM ||
+            lnum_op(op, x->num, y->num, &r)) {
+        c->ops[at] = c->base_ops[at] == OP_TAILCALLG ? OP_TAILCALLG_GLOBAL : OP_CALLG_GLOBAL;
+        return 0;
+    }
+    x->num = r;
+
+    lval_del(y);
+    vm.sp--;
+    return 1;
+}
+
+#ifdef LJIT
+
+/* A template JIT: each instruction of a hot code object is translated on
+   its own. Pushes, branches and the numeric fast path of the arithmetic
+   instructions run natively; every other instruction, and any guard that
+   fails, returns its pc so that lvm_run executes it and re-enters the
+   native code at the next instruction through a per-pc entry table. */
+
+enum { LJ_RAX, LJ_RCX, LJ_RDX, LJ_RBX, LJ_RSP, LJ_RBP, LJ_RSI, LJ_RDI,
+       LJ_R12 = 12, LJ_R13 };
+
+enum { LJ_O = 0x0, LJ_E = 0x4, LJ_NE = 0x5,
+       LJ_S = 0x8, LJ_L = 0xC, LJ_GE = 0xD, LJ_LE = 0xE, LJ_G = 0xF };
+
+typedef struct ljit_fixup {
+    int at;
+    int pc;
+    int exit;
+} ljit_fixup;
+
+typedef struct ljit {
+    unsigned char *buf;
+    int count;
+    int size;
+    int *labels;
+    int *exits;
+    int fixups_count;
+    ljit_fixup *fixups;
+    int epilogue;
+} ljit;
+
+void ljit_byte(ljit *j, int b) {
+    if (j->count == j->size) {
+        j->size = j->size ? j->size * 2 : 1024;
+        j->buf = realloc(j->buf, j->size);
+    }
+    j->buf[j->count++] = b;
+}
+
+void ljit_u32(ljit *j, uint32_t v) {
+    for (int i = 0; i < 4; ++i) ljit_byte(j, v >> (8 * i));
+}
+
+void ljit_imm(ljit *j, int reg, uint64_t v) {
+    ljit_byte(j, 0x48 | (reg >= 8));
+    ljit_byte(j, 0xB8 | (reg & 7));
+    for (int i = 0; i < 8; ++i) ljit_byte(j, v >> (8 * i));
+}
+
+void ljit_call(ljit *j, uint64_t fn) {
+    ljit_imm(j, LJ_RAX, fn);
+    ljit_byte(j, 0xFF);
+    ljit_byte(j, 0xD0);
+}
+
+/* op reg, [base + disp]; reg is the opcode extension for group opcodes */
+void ljit_rm(ljit *j, int wide, int op, int reg, int base, int disp) {
+    int rex = (wide ? 0x48 : 0x40) | (reg >= 8 ? 4 : 0) | (base >= 8);
+    if (rex != 0x40) ljit_byte(j, rex);
+    if (op > 0xFF) ljit_byte(j, op >> 8);
+    ljit_byte(j, op & 0xFF);
+    ljit_byte(j, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == LJ_RSP) ljit_byte(j, 0x24);
+    ljit_u32(j, disp);
+}
+
+void ljit_rel(ljit *j, int pc, int exit) {
+    j->fixups = realloc(j->fixups, sizeof(ljit_fixup) * (j->fixups_count + 1));
+    j->fixups[j->fixups_count++] = (ljit_fixup){ j->count, pc, exit };
+    ljit_u32(j, 0);
+}
+
+void ljit_jcc(ljit *j, int cc, int pc, int exit) {
+    ljit_byte(j, 0x0F);
+    ljit_byte(j, 0x80 | cc);
+    ljit_rel(j, pc, exit);
+}
+
+void ljit_jmp(ljit *j, int pc, int exit) {
+    ljit_byte(j, 0xE9);
+    ljit_rel(j, pc, exit);
+}
+
+void ljit_exit(ljit *j, int pc) {
+    ljit_byte(j, 0xB8);
+    ljit_u32(j, pc);
+    ljit_byte(j, 0xE9);
+    ljit_u32(j, j->epilogue - (j->count + 4));
+}
+
+/* Loads vm.stack[vm.sp - 1] into rsi and, when n is 2, the value below
+   it into rdi */
+void ljit_top(ljit *j, int n) {
+    ljit_rm(j, 1, 0x63, LJ_RAX, LJ_RBX, offsetof(lvm, sp));
+    ljit_rm(j, 1, 0x8B, LJ_RCX, LJ_RBX, offsetof(lvm, stack));
+    for (int i = 1; i <= n; ++i) {
+        ljit_byte(j, 0x48);
+        ljit_byte(j, 0x8B);
+        ljit_byte(j, 0x84 | (i == 1 ? LJ_RSI : LJ_RDI) << 3);
+        ljit_byte(j, 0xC1);
+        ljit_u32(j, -8 * i);
+    }
+}
+
+void ljit_type_guard(ljit *j, int reg, int type, int cc, int pc, int exit) {
+    ljit_rm(j, 0, 0x83, 7, reg, offsetof(lval, type));
+    ljit_byte(j, type);
+    ljit_jcc(j, cc, pc, exit);
+}
+
+/* Pops the top of the stack, which ljit_top left in rsi */
+void ljit_drop(ljit *j) {
+    ljit_rm(j, 0, 0xFF, 1, LJ_RBX, offsetof(lvm, sp));
+    ljit_byte(j, 0x48);
+    ljit_byte(j, 0x89);
+    ljit_byte(j, 0xF7);
+    ljit_call(j, (uintptr_t)lval_del);
+}
+
+/* Pushes a copy of the value in rdi */
+void ljit_push_copy(ljit *j) {
+    ljit_call(j, (uintptr_t)lval_copy);
+    ljit_byte(j, 0x48);
+    ljit_byte(j, 0x89);
+    ljit_byte(j, 0xC7);
+    ljit_call(j, (uintptr_t)lvm_push);
+}
+
+/* Leaves lroot->vals[slot] in reg after checking the name is unshadowed */
+void ljit_global(ljit *j, int pc, lval *sym, int slot, int reg) {
+    ljit_imm(j, LJ_RAX, (uintptr_t)&lsym_get(sym->sym)->shadows);
+    ljit_rm(j, 0, 0x83, 7, LJ_RAX, 0);
+    ljit_byte(j, 0);
+    ljit_jcc(j, LJ_NE, pc, 1);
+    ljit_imm(j, LJ_RAX, (uintptr_t)&lroot);
+    ljit_rm(j, 1, 0x8B, LJ_RAX, LJ_RAX, 0);
+    ljit_rm(j, 1, 0x8B, LJ_RAX, LJ_RAX, offsetof(lenv, vals));
+    ljit_rm(j, 1, 0x8B, reg, LJ_RAX, slot * sizeof(lval*));
+}
+
+void ljit_arith_op(ljit *j, int op, int pc);
+
+void ljit_arith(ljit *j, lcode *c, int pc) {
+    int op = c->ops[pc];
+    ljit_global(j, pc, c->consts[c->ops[pc + 1]], c->ops[pc + 3], LJ_RDX);
+    ljit_type_guard(j, LJ_RDX, LVAL_FUN, LJ_NE, pc, 1);
+    ljit_imm(j, LJ_RCX, (uintptr_t)lvm_arith_ops[op - OP_ADD2].func);
+    ljit_rm(j, 1, 0x39, LJ_RCX, LJ_RDX, offsetof(lval, builtin));
+    ljit_jcc(j, LJ_NE, pc, 1);
+
+    ljit_top(j, 2);
+    ljit_type_guard(j, LJ_RDI, LVAL_NUM, LJ_NE, pc, 1);
+    ljit_type_guard(j, LJ_RSI, LVAL_NUM, LJ_NE, pc, 1);
+    ljit_arith_op(j, op, pc);
+    ljit_drop(j);
+}
+
+/* Applies op to the num fields at rdi and rsi, leaving the result in the
+   one at rdi. Overflow, and the divisions the builtin handles, exit to pc. */
+void ljit_arith_op(ljit *j, int op, int pc) {
+    ljit_rm(j, 1, 0x8B, LJ_RAX, LJ_RDI, offsetof(lval, num));
+
+    int cc = -1;
+    switch (op) {
+        case OP_ADD2:
+            ljit_rm(j, 1, 0x03, LJ_RAX, LJ_RSI, offsetof(lval, num));
+            ljit_jcc(j, LJ_O, pc, 1);
+            break;
+        case OP_SUB2:
+            ljit_rm(j, 1, 0x2B, LJ_RAX, LJ_RSI, offsetof(lval, num));
+            ljit_jcc(j, LJ_O, pc, 1);
+            break;
+        case OP_MUL2:
+            ljit_rm(j, 1, 0x0FAF, LJ_RAX, LJ_RSI, offsetof(lval, num));
+            ljit_jcc(j, LJ_O, pc, 1);
+            break;
+        case OP_DIV2:
+        case OP_MOD2:
+            /* Division by zero and LONG_MIN / -1 are left to the builtin */
+            ljit_rm(j, 1, 0x83, 7, LJ_RSI, offsetof(lval, num));
+            ljit_byte(j, 0);
+            ljit_jcc(j, LJ_E, pc, 1);
+            ljit_rm(j, 1, 0x83, 7, LJ_RSI, offsetof(lval, num));
+            ljit_byte(j, 0xFF);
+            ljit_jcc(j, LJ_E, pc, 1);
+            ljit_byte(j, 0x48);
+            ljit_byte(j, 0x99);
+            ljit_rm(j, 1, 0xF7, 7, LJ_RSI, offsetof(lval, num));
+            if (op == OP_MOD2) {
+                /* mov rax, rdx */
+                ljit_byte(j, 0x48);
+                ljit_byte(j, 0x89);
+                ljit_byte(j, 0xD0);
+            }
+            break;
+        case OP_EQ2: cc = LJ_E; break;
+        case OP_NE2: cc = LJ_NE; break;
+        case OP_LT2: cc = LJ_L; break;
+        case OP_GT2: cc = LJ_G; break;
+        case OP_LE2: cc = LJ_LE; break;
+        case OP_GE2: cc = LJ_GE; break;
+    }
+    if (cc >= 0) {
+        ljit_rm(j, 1, 0x3B, LJ_RAX, LJ_RSI, offsetof(lval, num));
+        ljit_byte(j, 0x0F);
+        ljit_byte(j, 0x90 | cc);
+        ljit_byte(j, 0xC0);
+        ljit_byte(j, 0x0F);
+        ljit_byte(j, 0xB6);
+        ljit_byte(j, 0xC0);
+    }
+    ljit_rm(j, 1, 0x89, LJ_RAX, LJ_RDI, offsetof(lval, num));
+}
+
+/* Burns a step of fuel, leaving to the interpreter at pc once it runs
+   out so that lfuel_refill decides whether to go on */
+void ljit_tick(ljit *j, int pc) {
+    ljit_imm(j, LJ_RAX, (uintptr_t)&lfuel);
+    ljit_rm(j, 1, 0x83, 5, LJ_RAX, 0);
+    ljit_byte(j, 1);
+    ljit_jcc(j, LJ_S, pc, 1);
+}
+
+/* Loads the address of lvm_nums[i] into reg, offset so that it can stand
+   in for an lval in ljit_arith_op */
+void ljit_num(ljit *j, int reg, int i, int as_lval) {
+    uintptr_t at = (uintptr_t)&lvm_nums[i];
+    ljit_imm(j, reg, as_lval ? at - offsetof(lval, num) : at);
+}
+
+void ljit_instr(ljit *j, lcode *c, int pc) {
+    int *ops = c->ops;
+    switch (ops[pc]) {
+        case OP_CONST:
+            ljit_imm(j, LJ_RDI, (uintptr_t)c->consts[ops[pc + 1]]);
+            ljit_push_copy(j);
+            break;
+
+        case OP_LOCAL:
+            ljit_rm(j, 1, 0x8B, LJ_RAX, LJ_R12, offsetof(lenv, vals));
+            ljit_rm(j, 1, 0x8B, LJ_RDI, LJ_RAX, ops[pc + 1] * sizeof(lval*));
+            ljit_push_copy(j);
+            break;
+
+        case OP_GLOBAL:
+            ljit_global(j, pc, c->consts[ops[pc + 1]], ops[pc + 2], LJ_RDI);
+            ljit_push_copy(j);
+            break;
+
+        case OP_ADD2: case OP_SUB2: case OP_MUL2: case OP_DIV2:
+        case OP_MOD2: case OP_EQ2: case OP_NE2: case OP_LT2: case OP_GT2:
+        case OP_LE2: case OP_GE2:
+            ljit_arith(j, c, pc);
+            break;
+
+        case OP_NLOCAL:
+            ljit_rm(j, 1, 0x8B, LJ_RAX, LJ_R12, offsetof(lenv, vals));
+            ljit_rm(j, 1, 0x8B, LJ_RDX, LJ_RAX, ops[pc + 2] * sizeof(lval*));
+            ljit_rm(j, 1, 0x8B, LJ_RAX, LJ_RDX, offsetof(lval, num));
+            ljit_num(j, LJ_RCX, ops[pc + 1], 0);
+            ljit_rm(j, 1, 0x89, LJ_RAX, LJ_RCX, 0);
+            break;
+
+        case OP_NCONST:
+            ljit_imm(j, LJ_RAX, (uintptr_t)c->consts[ops[pc + 2]]->num);
+            ljit_num(j, LJ_RCX, ops[pc + 1], 0);
+            ljit_rm(j, 1, 0x89, LJ_RAX, LJ_RCX, 0);
+            break;
+
+        case OP_NARITH:
+            ljit_num(j, LJ_RDI, ops[pc + 2] - 1, 1);
+            ljit_num(j, LJ_RSI, ops[pc + 2], 1);
+            ljit_arith_op(j, ops[pc + 1], pc);
+            break;
+
+        case OP_NBOX:
+            ljit_num(j, LJ_RAX, 0, 0);
+            ljit_rm(j, 1, 0x8B, LJ_RDI, LJ_RAX, 0);
+            ljit_call(j, (uintptr_t)lval_num);
+            ljit_byte(j, 0x48);
+            ljit_byte(j, 0x89);
+            ljit_byte(j, 0xC7);
+            ljit_call(j, (uintptr_t)lvm_push);
+            break;
+
+        case OP_NIF:
+            ljit_num(j, LJ_RAX, 0, 0);
+            ljit_rm(j, 1, 0x83, 7, LJ_RAX, 0);
+            ljit_byte(j, 0);
+            ljit_jcc(j, LJ_E, ops[pc + 1], 0);
+            break;
+
+        case OP_GUARDT:
+            ljit_rm(j, 1, 0x8B, LJ_RAX, LJ_R12, offsetof(lenv, vals));
+            ljit_rm(j, 1, 0x8B, LJ_RDX, LJ_RAX, ops[pc + 1] * sizeof(lval*));
+            ljit_type_guard(j, LJ_RDX, ops[pc + 2], LJ_NE, ops[pc + 3], 0);
+            break;
+
+        case OP_IF:
+        case OP_WHILE:
+            ljit_top(j, 1);
+            ljit_type_guard(j, LJ_RSI, LVAL_NUM, LJ_NE, pc, 1);
+            ljit_rm(j, 1, 0x8B, LJ_R13, LJ_RSI, offsetof(lval, num));
+            ljit_drop(j);
+            ljit_byte(j, 0x4D);
+            ljit_byte(j, 0x85);
+            ljit_byte(j, 0xED);
+            ljit_jcc(j, LJ_E, ops[pc + 1], 0);
+            break;
+
+        case OP_JUMP:
+            if (ops[pc + 1] < pc) ljit_tick(j, pc);
+            ljit_jmp(j, ops[pc + 1], 0);
+            break;
+
+        case OP_GUARD: {
+            lval *g = c->consts[ops[pc + 2]];
+            ljit_global(j, pc, c->consts[ops[pc + 1]], ops[pc + 3], LJ_RDX);
+            ljit_type_guard(j, LJ_RDX, LVAL_FUN, LJ_NE, ops[pc + 4], 0);
+            ljit_imm(j, LJ_RCX, (uintptr_t)g->builtin);
+            ljit_rm(j, 1, 0x39, LJ_RCX, LJ_RDX, offsetof(lval, builtin));
+            ljit_jcc(j, LJ_NE, ops[pc + 4], 0);
+            if (g->builtin) {
+                ljit_imm(j, LJ_RCX, (uintptr_t)g->memo);
+                ljit_rm(j, 1, 0x39, LJ_RCX, LJ_RDX, offsetof(lval, memo));
+                ljit_jcc(j, LJ_NE, ops[pc + 4], 0);
+            } else {
+                ljit_imm(j, LJ_RCX, (uintptr_t)g->code);
+                ljit_rm(j, 1, 0x39, LJ_RCX, LJ_RDX, offsetof(lval, code));
+                ljit_jcc(j, LJ_NE, ops[pc + 4], 0);
+            }
+            break;
+        }
+
+        case OP_POP:
+            ljit_top(j, 1);
+            ljit_drop(j);
+            break;
+
+        case OP_AND:
+        case OP_OR:
+            ljit_top(j, 1);
+            ljit_type_guard(j, LJ_RSI, LVAL_NUM, LJ_NE, pc, 1);
+            ljit_rm(j, 1, 0x83, 7, LJ_RSI, offsetof(lval, num));
+            ljit_byte(j, 0);
+            ljit_jcc(j, ops[pc] == OP_AND ? LJ_E : LJ_NE, ops[pc + 2], 0);
+            ljit_drop(j);
+            break;
+
+        /* Over a range, only a loop variable that no longer holds a
+           number leaves the native code */
+        case OP_LOOP:
+            ljit_tick(j, pc);
+            ljit_rm(j, 1, 0x8B, LJ_RAX, LJ_R12, offsetof(lenv, vals));
+            ljit_rm(j, 1, 0x8B, LJ_RDX, LJ_RAX, sizeof(lval*));
+            ljit_rm(j, 1, 0x8B, LJ_RCX, LJ_RAX, 2 * sizeof(lval*));
+            ljit_rm(j, 1, 0x8B, LJ_RSI, LJ_RDX, offsetof(lval, num));
+            ljit_rm(j, 1, 0x3B, LJ_RSI, LJ_RCX, offsetof(lval, num));
+            ljit_jcc(j, LJ_GE, pc + 2, 0);
+            ljit_rm(j, 1, 0x8B, LJ_RDI, LJ_RAX, 0);
+            ljit_type_guard(j, LJ_RDI, LVAL_NUM, LJ_NE, pc, 1);
+            ljit_rm(j, 1, 0x89, LJ_RSI, LJ_RDI, offsetof(lval, num));
+            ljit_rm(j, 1, 0x83, 0, LJ_RDX, offsetof(lval, num));
+            ljit_byte(j, 1);
+            ljit_jmp(j, ops[pc + 1], 0);
+            break;
+
+        default:
+            ljit_exit(j, pc);
+            break;
+    }
+}
+
+size_t ljit_map_size(lcode *c) {
+    return ((c->native_size + 7) & ~7) + sizeof(uintptr_t) * c->count;
+}
+
+void ljit_compile(lcode *c) {
+    ljit j = { NULL, 0, 0, NULL, NULL, 0, NULL, 0 };
+    j.labels = malloc(sizeof(int) * c->count);
+    j.exits = malloc(sizeof(int) * c->count);
+    for (int i = 0; i < c->count; ++i) j.labels[i] = j.exits[i] = -1;
+
+    /* int f(lenv *env, int pc): env stays in r12 and &vm in rbx */
+    ljit_byte(&j, 0x53);
+    ljit_byte(&j, 0x41);
+    ljit_byte(&j, 0x54);
+    ljit_byte(&j, 0x41);
+    ljit_byte(&j, 0x55);
+    ljit_byte(&j, 0x49);
+    ljit_byte(&j, 0x89);
+    ljit_byte(&j, 0xFC);
+    ljit_imm(&j, LJ_RBX, (uintptr_t)&vm);
+    ljit_byte(&j, 0x48);
+    ljit_byte(&j, 0x63);
+    ljit_byte(&j, 0xF6);
+    ljit_byte(&j, 0x48);
+    ljit_byte(&j, 0x8D);
+    ljit_byte(&j, 0x05);
+    int table_rel = j.count;
+    ljit_u32(&j, 0);
+    ljit_byte(&j, 0xFF);
+    ljit_byte(&j, 0x24);
+    ljit_byte(&j, 0xF0);
+
+    j.epilogue = j.count;
+    ljit_byte(&j, 0x41);
+    ljit_byte(&j, 0x5D);
+    ljit_byte(&j, 0x41);
+    ljit_byte(&j, 0x5C);
+    ljit_byte(&j, 0x5B);
+    ljit_byte(&j, 0xC3);
+
+    for (int pc = 0; pc < c->count; pc += lop_width(c->ops[pc])) {
+        j.labels[pc] = j.count;
+        ljit_instr(&j, c, pc);
+    }
+
+    for (int i = 0; i < j.fixups_count; ++i) {
+        ljit_fixup *f = &j.fixups[i];
+        int target = j.labels[f->pc];
+        if (f->exit) {
+            if (j.exits[f->pc] < 0) {
+                j.exits[f->pc] = j.count;
+                ljit_exit(&j, f->pc);
+            }
+            target = j.exits[f->pc];
+        }
+        int32_t rel = target - (f->at + 4);
+        memcpy(&j.buf[f->at], &rel, 4);
+    }
+
+    c->native_size = j.count;
+    int table = (j.count + 7) & ~7;
+    int32_t rel = table - (table_rel + 4);
+    memcpy(&j.buf[table_rel], &rel, 4);
+
+    size_t size = ljit_map_size(c);
+    unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED) {
+        memcpy(mem, j.buf, j.count);
+        uintptr_t *entries = (uintptr_t*)(mem + table);
+        for (int i = 0; i < c->count; ++i) {
+            entries[i] = j.labels[i] < 0 ? 0 : (uintptr_t)(mem + j.labels[i]);
+        }
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC) == 0) {
+            c->native = mem;
+            memcpy(&c->jit, &mem, sizeof(c->jit));
+        } else {
+            munmap(mem, size);
+        }
+    }
+    if (!c->native) c->native_size = 0;
+
+    free(j.buf);
+    free(j.labels);
+    free(j.exits);
+    free(j.fixups);
+}
+
+/* Counts an entry into c and compiles it once it is hot. The count stops
+   one past the threshold, after the one attempt to compile, so it cannot
+   overflow; code that got hot while the JIT was off is compiled the next
+   time it is entered with the JIT on. */
+void ljit_count(lcode *c) {
+    if (c->calls < ljit_threshold) c->calls++;
+    if (c->calls == ljit_threshold && ljit_enabled) {
+        c->calls++;
+        ljit_compile(c);
+    }
+}
+
+#endif
+
+/* Runs the frames above base, from the pc of the top one, until base
+   returns. A generator's run also returns NULL when it yields. */
+lval *lvm_run(int base) {
+    lframe *fr = &vm.frames[vm.fp - 1];
+    int *ops = fr->code->ops;
+    lval **consts = fr->code->consts;
+    lenv *env = fr->env;
+    int pc = fr->pc;
+
+    for (;;) {
+#ifdef LJIT
+        if (fr->code->jit && ljit_enabled) pc = fr->code->jit(env, pc);
+#endif
+        switch (ops[pc++]) {
+            case OP_CONST:
+                lvm_push(lval_copy(consts[ops[pc++]]));
+                break;
+
+            case OP_LOCAL:
+                lvm_push(lval_copy(env->vals[ops[pc++]]));
+                break;
+
+            case OP_LOOKUP: {
+                lval *sym = consts[ops[pc]];
+                int slot = lvm_global_slot(sym->sym);
+                if (slot >= 0) {
+                    ops[pc - 1] = OP_GLOBAL;
+                    ops[pc + 1] = slot;
+                }
+                lvm_push(lenv_get(env, sym));
+                pc += 2;
+                if (vm.stack[vm.sp - 1]->type == LVAL_ERR) goto raise;
+                break;
+            }
+
+            case OP_GLOBAL: {
+                lval *sym = consts[ops[pc]];
+                if (lsym_get(sym->sym)->shadows) {
+                    ops[pc - 1] = OP_LOOKUP;
+                    pc--;
+                    break;
+                }
+                lvm_push(lval_copy(lroot->vals[ops[pc + 1]]));
+                pc += 2;
+                break;
+            }
+
+            case OP_ADD2:
+            case OP_SUB2:
+            case OP_MUL2:
+            case OP_DIV2:
+            case OP_MOD2:
+            case OP_EQ2:
+            case OP_NE2:
+            case OP_LT2:
+            case OP_GT2:
+            case OP_LE2:
+            case OP_GE2:
+                if (lvm_arith(fr->code, pc - 1)) {
+                    pc += 3;
+                } else {
+                    pc--;
+                }
+                break;
+
+            case OP_IF:
+            case OP_WHILE: {
+                lval *x = vm.stack[vm.sp - 1];
+                if (x->type != LVAL_NUM) {
+                    vm.stack[vm.sp - 1] = lval_err(
+                            "Function '%s' passed incorrect type for argument %i. "
+                            "Got %s, Expected %s.",
+                            ops[pc - 1] == OP_IF ? "if" : "while", 0,
+                            ltype_name(x->type), ltype_name(LVAL_NUM));
+                    lval_del(x);
+                    goto raise;
+                }
+                vm.sp--;
+                pc = x->num ? pc + 1 : ops[pc];
+                lval_del(x);
+                break;
+            }
+
+            case OP_JUMP:
+                if (ops[pc] < pc && --lfuel < 0) {
+                    lval *err = lfuel_refill();
+                    if (err) {
+                        lvm_push(err);
+                        goto raise;
+                    }
+                }
+                pc = ops[pc];
+                break;
+
+            case OP_POP:
+                lval_del(vm.stack[--vm.sp]);
+                break;
+
+            case OP_AND:
+            case OP_OR: {
+                lval *x = vm.stack[vm.sp - 1];
+                int op = ops[pc - 1];
+                if (x->type == LVAL_NUM && (x->num != 0) != (op == OP_OR)) {
+                    vm.sp--;
+                    lval_del(x);
+                    pc += 2;
+                    break;
+                }
+                if (x->type != LVAL_NUM) {
+                    vm.stack[vm.sp - 1] = lval_err(
+                            "Function '%s' passed invalid type for argument %i. "
+                            "Got %s, Expected %s.",
+                            op == OP_OR ? "or" : "and", ops[pc],
+                            ltype_name(x->type), ltype_name(LVAL_NUM));
+                    lval_del(x);
+                    goto raise;
+                }
+                pc = ops[pc + 1];
+                break;
+            }
+
+            case OP_LAMBDA: {
+                lval *f = lval_copy(consts[ops[pc++]]);
+                lenv *ns = lenv_namespace(env);
+                if (ns->module) f->ns = ns;
+                lvm_push(f);
+                break;
+            }
+
+            case OP_DEF: {
+                lval *syms = consts[ops[pc++]];
+                int n = ops[pc++];
+                for (int i = 0; i < n; ++i) {
+                    lval *x = vm.stack[vm.sp - n + i];
+                    lenv_def(env, syms->cell[i], x);
+                    lval_del(x);
+                }
+                vm.sp -= n;
+                lvm_push(lval_sexpr());
+                break;
+            }
+
+            case OP_GUARD: {
+                lval *sym = consts[ops[pc]];
+                if (!lsym_get(sym->sym)->shadows &&
+                        lval_same_fun(lroot->vals[ops[pc + 2]], consts[ops[pc + 1]])) {
+                    pc += 4;
+                } else {
+                    pc = ops[pc + 3];
+                }
+                break;
+            }
+
+            case OP_GUARDT:
+                if (env->vals[ops[pc]]->type == (lval_type)ops[pc + 1]) {
+                    pc += 3;
+                } else {
+                    pc = ops[pc + 2];
+                }
+                break;
+
+            case OP_NLOCAL:
+                lvm_nums[ops[pc]] = env->vals[ops[pc + 1]]->num;
+                pc += 2;
+                break;
+
+            case OP_NCONST:
+                lvm_nums[ops[pc]] = consts[ops[pc + 1]]->num;
+                pc += 2;
+                break;
+
+            case OP_NARITH: {
+                long *x = &lvm_nums[ops[pc + 1] - 1];
+                if (lnum_op(ops[pc], x[0], x[1], x)) {
+                    lvm_push(lnum_err(x[1]));
+                    goto raise;
+                }
+                pc += 2;
+                break;
+            }
+
+            case OP_NBOX:
+                lvm_push(lval_num(lvm_nums[0]));
+                break;
+
+            case OP_NIF:
+                pc = lvm_nums[0] ? pc + 1 : ops[pc];
+                break;
+
+            case OP_LET: {
+                lval *f = consts[ops[pc++]];
+                int tail = ops[pc++];
+                lenv *scope = lenv_new();
+                scope->par = env;
+                fr->pc = pc;
+                if (!lvm_enter(f->code, scope, 1, tail)) goto raise;
+                fr = &vm.frames[vm.fp - 1];
+                ops = fr->code->ops;
+                consts = fr->code->consts;
+                env = fr->env;
+                pc = 0;
+                break;
+            }
+
+            case OP_MATCH:
+                lvm_match[0] = vm.stack[vm.sp - 1];
+                break;
+
+            case OP_MLIST: {
+                lval *x = lvm_match[ops[pc]];
+                int n = ops[pc + 1];
+                if (x->type == LVAL_QEXPR && (x->count == n || (ops[pc + 2] && x->count > n))) {
+                    pc += 4;
+                } else {
+                    pc = ops[pc + 3];
+                }
+                break;
+            }
+
+            case OP_MEQ:
+                if (lval_eq(lvm_match[ops[pc]], consts[ops[pc + 1]])) {
+                    pc += 3;
+                } else {
+                    pc = ops[pc + 2];
+                }
+                break;
+
+            case OP_MCELL:
+                lvm_match[ops[pc + 2]] = lvm_match[ops[pc]]->cell[ops[pc + 1]];
+                pc += 3;
+                break;
+
+            /* The parts a clause binds never overlap and the value matched
+               is dropped after them, so they are moved out of it rather
+               than copied */
+            case OP_MBIND: {
+                lval *x = lvm_match[ops[pc++]];
+                lval *v = malloc(sizeof(lval));
+                *v = *x;
+                x->type = LVAL_NUM;
+                lvm_push(v);
+                break;
+            }
+
+            case OP_MREST: {
+                lval *x = lvm_match[ops[pc]];
+                int from = ops[pc + 1];
+                lval *rest = lval_qexpr();
+                rest->count = x->count - from;
+                rest->cell = malloc(sizeof(lval*) * rest->count);
+                memcpy(rest->cell, &x->cell[from], sizeof(lval*) * rest->count);
+                x->count = from;
+                lvm_push(rest);
+                pc += 2;
+                break;
+            }
+
+            case OP_QUASI: {
+                int n = ops[pc + 1];
+                lval *flags = consts[ops[pc + 2]];
+                lval **parts = &vm.stack[vm.sp - n];
+                int size = 0;
+                for (int i = 0; i < n; ++i) {
+                    if (!flags->cell[i]->num) {
+                        size++;
+                    } else if (parts[i]->type == LVAL_QEXPR) {
+                        size += parts[i]->count;
+                    } else {
+                        lvm_push(lquasi_splice_err(parts[i]->type));
+                        goto raise;
+                    }
+                }
+
+                lval *r = ops[pc] == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+                if (size) r->cell = malloc(sizeof(lval*) * size);
+                for (int i = 0; i < n; ++i) {
+                    if (flags->cell[i]->num) {
+                        lval *y = parts[i];
+                        if (y->count) {
+                            memcpy(&r->cell[r->count], y->cell, sizeof(lval*) * y->count);
+                            r->count += y->count;
+                        }
+                        free(y->cell);
+                        free(y);
+                    } else {
+                        r->cell[r->count++] = parts[i];
+                    }
+                }
+                vm.sp -= n;
+                lvm_push(r);
+                pc += 3;
+                break;
+            }
+
+            case OP_MDROP: {
+                int n = ops[pc++];
+                lval_del(vm.stack[vm.sp - n - 1]);
+                memmove(&vm.stack[vm.sp - n - 1], &vm.stack[vm.sp - n], sizeof(lval*) * n);
+                vm.sp--;
+                break;
+            }
+
+            case OP_ENTER: {
+                lval *f = consts[ops[pc++]];
+                int tail = ops[pc++];
+                lenv *scope = lvm_bind_fixed(f, f->formals->count);
+                scope->par = env;
+                scope->loop = f->code->loop;
+                fr->pc = pc;
+                if (!lvm_enter(f->code, scope, 1, tail)) goto raise;
+                fr = &vm.frames[vm.fp - 1];
+                ops = fr->code->ops;
+                consts = fr->code->consts;
+                env = fr->env;
+                pc = 0;
+                break;
+            }
+
+            case OP_LOOP: {
+                lval **v = env->vals;
+                if (--lfuel < 0) {
+                    lval *err = lfuel_refill();
+                    if (err) {
+                        lvm_push(err);
+                        goto raise;
+                    }
+                }
+#ifdef LJIT
+                ljit_count(fr->code);
+#endif
+                if (v[1]->num >= v[2]->num) {
+                    pc++;
+                    break;
+                }
+                if (v[0]->type != LVAL_NUM) {
+                    lval_del(v[0]);
+                    v[0] = lval_num(0);
+                }
+                v[0]->num = v[1]->num++;
+                pc = ops[pc];
+                break;
+            }
+
+            /* The element taken and the previous value of the variable
+               trade places, and the list is dropped along with the frame */
+            case OP_EACH: {
+                lval **v = env->vals;
+                if (--lfuel < 0) {
+                    lval *err = lfuel_refill();
+                    if (err) {
+                        lvm_push(err);
+                        goto raise;
+                    }
+                }
+#ifdef LJIT
+                ljit_count(fr->code);
+#endif
+                if (v[2]->num >= v[1]->count) {
+                    pc++;
+                    break;
+                }
+                lval *x = v[1]->cell[v[2]->num];
+                v[1]->cell[v[2]->num++] = v[0];
+                v[0] = x;
+                pc = ops[pc];
+                break;
+            }
+
+            case OP_TRY:
+                lvm_push_try(ops[pc++]);
+                break;
+
+            case OP_UNTRY:
+                vm.tries_count--;
+                break;
+
+            case OP_CATCH: {
+                lval *f = consts[ops[pc++]];
+                int tail = ops[pc++];
+                lenv *scope = lenv_new();
+                scope->par = env;
+                lenv_put(scope, f->formals->cell[0], vm.stack[vm.sp - 1]);
+                lval_del(vm.stack[--vm.sp]);
+                fr->pc = pc;
+                if (!lvm_enter(f->code, scope, 1, tail)) goto raise;
+                fr = &vm.frames[vm.fp - 1];
+                ops = fr->code->ops;
+                consts = fr->code->consts;
+                env = fr->env;
+                pc = 0;
+                break;
+            }
+
+            case OP_THROW:
+                goto raise;
+
+            case OP_YIELD:
+                if (!lgen_active || base != 0) {
+                    lval_del(vm.stack[--vm.sp]);
+                    lvm_push(lval_err(lgen_active ?
+                            "Cannot yield from inside a builtin call." :
+                            "Cannot yield outside of a generator."));
+                    goto raise;
+                }
+                lgen_active->value = vm.stack[--vm.sp];
+                lvm_push(lval_sexpr());
+                fr->pc = pc;
+                return NULL;
+
+            case OP_CALL:
+            case OP_CALLG:
+            case OP_TAILCALL:
+            case OP_TAILCALLG:
+            case OP_CALLG_GLOBAL:
+            case OP_TAILCALLG_GLOBAL: {
+                lval *f;
+                int op = ops[pc - 1];
+                int owned = op == OP_CALL || op == OP_TAILCALL;
+                int tail = op == OP_TAILCALL || op == OP_TAILCALLG || op == OP_TAILCALLG_GLOBAL;
+                int n;
+                if (owned) {
+                    n = ops[pc++] - 1;
+                    f = vm.stack[vm.sp - n - 1];
+                    memmove(&vm.stack[vm.sp - n - 1], &vm.stack[vm.sp - n],
+                            sizeof(lval*) * n);
+                    vm.sp--;
+                } else {
+                    lval *sym = consts[ops[pc]];
+                    n = ops[pc + 1];
+                    if (op == OP_CALLG_GLOBAL || op == OP_TAILCALLG_GLOBAL) {
+                        if (lsym_get(sym->sym)->shadows) {
+                            ops[pc - 1] = fr->code->base_ops[pc - 1];
+                            pc--;
+                            break;
+                        }
+                        f = lroot->vals[ops[pc + 2]];
+                    } else {
+                        lvm_quicken_call(fr->code, pc - 1);
+                        f = lenv_lookup(env, sym->sym);
+                    }
+                    pc += 3;
+                    if (!f) {
+                        lvm_push(lval_err("Unbound symbol '%s'!", sym->sym));
+                        goto raise;
+                    }
+                }
+
+                if (f->type != LVAL_FUN) {
+                    if (owned) lval_del(f);
+                    lvm_push(lval_err("S-expression does not start with function"));
+                    goto raise;
+                }
+
+                fr->pc = pc;
+                if (lvm_invoke(env, f, owned, n, tail)) {
+                    fr = &vm.frames[vm.fp - 1];
+                    ops = fr->code->ops;
+                    consts = fr->code->consts;
+                    env = fr->env;
+                    pc = 0;
+                } else {
+                    fr = &vm.frames[vm.fp - 1];
+                    if (vm.stack[vm.sp - 1]->type == LVAL_ERR) goto raise;
+                }
+                break;
+            }
+
+            case OP_RET: {
+                lval *x = vm.stack[--vm.sp];
+                lvm_pop_frame();
+                if (vm.fp == base) return x;
+
+                lvm_push(x);
+                fr = &vm.frames[vm.fp - 1];
+                ops = fr->code->ops;
+                consts = fr->code->consts;
+                env = fr->env;
+                pc = fr->pc;
+                break;
+            }
+        }
+        continue;
+
+    raise: {
+            lval *err = lvm_unwind(base);
+            if (err) return err;
+            fr = &vm.frames[vm.fp - 1];
+            ops = fr->code->ops;
+            consts = fr->code->consts;
+            env = fr->env;
+            pc = fr->pc;
+        }
+    }
+}
+
+lval *lvm_exec(lenv *e, lcode *c) {
+    if (lstack_exhausted() || vm.fp >= lvm_frames_max) {
+        return lval_err("stack limit exceeded");
+    }
+    if (--lfuel < 0) {
+        lval *err = lfuel_refill();
+        if (err) return err;
+    }
+    lvm_push_frame(c, e, 0);
+    return lvm_run(vm.fp - 1);
+}
+
+lgen *lgen_new(lval *func) {
+    lgen *g = malloc(sizeof(lgen));
+    g->vm = (lvm){ 0, 0, NULL, 0, 0, NULL, 0, 0, NULL };
+    g->func = func;
+    g->value = NULL;
+    g->running = 0;
+    return g;
+}
+
+void lgen_del(lgen *g) {
+    lvm caller = vm;
+    vm = g->vm;
+    while (vm.fp) lvm_pop_frame();
+    while (vm.sp) lval_del(vm.stack[--vm.sp]);
+    free(vm.stack);
+    free(vm.frames);
+    free(vm.tries);
+    vm = caller;
+    if (g->func) lval_del(g->func);
+    free(g);
+}
+
+/* Resumes g until it yields, returning the value, or finishes, returning
+   NULL. An error it raises finishes it and is returned. */
+lval *lgen_resume(lgen *g) {
+    if (g->running) return lval_err("Generator resumed while it is running.");
+    if (!g->func && !g->vm.fp) return NULL;
+    if (lstack_exhausted()) return lval_err("stack limit exceeded");
+
+    lvm caller = vm;
+    vm = g->vm;
+    lgen *outer = lgen_active;
+    lgen_active = g;
+    g->running = 1;
+
+    if (g->func) {
+        lcomp k = { lcode_new(), lroot, 0, NULL };
+        for (int i = 0; i < g->func->count; ++i) {
+            lcomp_emit(&k, OP_CONST);
+            lcomp_emit(&k, lcomp_const(&k, lval_copy(g->func->cell[i])));
+        }
+        lcomp_emit(&k, OP_CALL);
+        lcomp_emit(&k, g->func->count);
+        lcomp_finish(&k);
+        lval_del(g->func);
+        g->func = NULL;
+        lvm_push_frame(k.code, lroot, 0);
+        lcode_release(k.code);
+    }
+    lval *x = lvm_run(0);
+
+    g->running = 0;
+    lgen_active = outer;
+    g->vm = vm;
+    vm = caller;
+
+    if (!x) {
+        x = g->value;
+        g->value = NULL;
+        return x;
+    }
+    if (x->type == LVAL_ERR) return x;
+    lval_del(x);
+    return NULL;
+}
+
+/* Each evaluation started from the top level gets the limits afresh */
+lval *lval_exec(lenv *e, lval *v) {
+    if (!vm.fp) lfuel_start();
+    lcode *c = lval_compile_expr(e, v);
+    lval_del(v);
+    lval *x = lvm_exec(e, c);
+    lcode_release(c);
+    return x;
+}
+
+/* A loop's scope binds only its own variables, so = in the body of a
+   loop binds in the frame around it, the way it does in a while loop */
+lenv *lenv_put_target(lenv *e, lval *k) {
+    while (e->loop && e->par && lenv_find(e, k->sym) < 0) e = e->par;
+    return e;
+}
+
+lval *builtin_var(lenv *e, lval *a, char *func) {
+    assert(a->type == LVAL_SEXPR);
+    assert(a->count > 0);
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+    lval *syms = a->cell[0];
+
+    for (int i = 0; i < syms->count; ++i) {
+        LASSERT(a, syms->cell[i]->type == LVAL_SYM,
+                "Function '%s' passed invalid type for argument %i. "
+                "Got %s, Expected %s.",
+                func, i, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+    }
+
+    LASSERT(a, syms->count == a->count - 1,
+            "Incorrect no. of arguments to function '%s'. "
+            "Symbols: %i, Values: %i.",
+            func, syms->count, a->count - 1);
+
+    for (int i = 0; i < syms->count; ++i) {
+        if (strcmp(func, "def") == 0) {
+            lenv_def(e, syms->cell[i], a->cell[i+1]);
+        }
+        if (strcmp(func, "=") == 0) {
+            lenv_put(lenv_put_target(e, syms->cell[i]), syms->cell[i], a->cell[i+1]);
+        }
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval *builtin_def(lenv *e, lval *a) {
+    return builtin_var(e, a, "def");
+}
+
+lval *builtin_put(lenv *e, lval *a) {
+    return builtin_var(e, a, "=");
+}
+
+/* set! moves each value into the binding its symbol already has, in
+   whichever env holds it, instead of copying it into a new one */
+lval *builtin_set(lenv *e, lval *a) {
+    LASSERT(a, a->count > 0,
+            "Function 'set!' passed incorrect no. of arguments. "
+            "Got %i, Expected at least %i.", a->count, 1);
+    LASSERT_TYPE("set!", a, 0, LVAL_QEXPR);
+
+    lval *syms = a->cell[0];
+    for (int i = 0; i < syms->count; ++i) {
+        LASSERT(a, syms->cell[i]->type == LVAL_SYM,
+                "Function 'set!' passed invalid type for argument %i. "
+                "Got %s, Expected %s.",
+                i, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+        LASSERT(a, lenv_ref(e, syms->cell[i]->sym),
+                "Unbound symbol '%s'!", syms->cell[i]->sym);
+    }
+    LASSERT(a, syms->count == a->count - 1,
+            "Incorrect no. of arguments to function 'set!'. "
+            "Symbols: %i, Values: %i.",
+            syms->count, a->count - 1);
+
+    /* The replaced values are swapped into a, which frees them */
+    for (int i = 0; i < syms->count; ++i) {
+        lval **v = lenv_ref(e, syms->cell[i]->sym);
+        lval *old = *v;
+        *v = a->cell[i + 1];
+        a->cell[i + 1] = old;
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval *builtin_box(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("box", a, 1);
+    return lval_box(lval_take(a, 0));
+}
+
+lval *builtin_unbox(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("unbox", a, 1);
+    LASSERT_TYPE("unbox", a, 0, LVAL_BOX);
+    lval *x = lval_copy(a->cell[0]->box->value);
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_set_box(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("set-box!", a, 2);
+    LASSERT_TYPE("set-box!", a, 0, LVAL_BOX);
+    lbox *b = a->cell[0]->box;
+    lval *old = b->value;
+    b->value = a->cell[1];
+    a->cell[1] = old;
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval *builtin(lenv *e, lval *a, char *func) {
+    if (strcmp("list", func) == 0) return builtin_list(e, a);
+    if (strcmp("head", func) == 0) return builtin_head(e, a);
+    if (strcmp("tail", func) == 0) return builtin_tail(e, a);
+    if (strcmp("eval", func) == 0) return builtin_eval(e, a);
+    if (strcmp("join", func) == 0) return builtin_join(e, a);
+    if (strcmp("+", func) == 0) return builtin_add(e, a);
+    if (strcmp("-", func) == 0) return builtin_sub(e, a);
+    if (strcmp("*", func) == 0) return builtin_mul(e, a);
+    if (strcmp("/", func) == 0) return builtin_div(e, a);
+    lval_del(a);
+    return lval_err("Unknown function!");
+}
+
+lval *builtin_load(lenv *e, lval *a) {
+    LASSERT_NUM("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+    mpc_result_t r;
+    if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
+        lval *expr = lval_read(r.output);
+        mpc_ast_delete(r.output);
+
+        while (expr->count) {
+            lval *x = lval_exec(e, lval_pop(expr, 0));
+            if (x->type == LVAL_ERR) lval_println(x);
+            lval_del(x);
+        }
+
+        lval_del(expr);
+        lval_del(a);
+
+        return lval_sexpr();
+    } else {
+        char *err_msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+
+        lval *err = lval_err("Could not load library %s", err_msg);
+        free(err_msg);
+        lval_del(a);
+
+        return err;
+    }
+}
+
+lmodule *lmodule_get(char *name) {
+    for (int i = 0; i < modules_count; ++i) {
+        if (strcmp(modules[i]->name, name) == 0) return modules[i];
+    }
+    return NULL;
+}
+
+lmodule *lmodule_new(lenv *root, char *name) {
+    lmodule *m = malloc(sizeof(lmodule));
+    m->name = malloc(strlen(name) + 1);
+    strcpy(m->name, name);
+    m->env = lenv_new();
+    m->env->par = root;
+    m->env->module = m;
+    m->ready = 0;
+    m->count = 0;
+    m->syms = NULL;
+    m->slots = NULL;
+
+    modules_count++;
+    modules = realloc(modules, sizeof(lmodule*) * modules_count);
+    modules[modules_count - 1] = m;
+    return m;
+}
+
+void lmodule_del(lmodule *m) {
+    free(m->syms);
+    free(m->slots);
+    free(m->name);
+    lenv_del(m->env);
+    free(m);
+}
+
+/* Builds the export table once every exported symbol is known to be
+   defined, so a failed module exports nothing */
+lval *lmodule_export(lmodule *m, lval *exports) {
+    for (int i = 0; i < exports->count; ++i) {
+        if (lenv_find(m->env, exports->cell[i]->sym) < 0) {
+            return lval_err("Module '%s' does not define exported symbol '%s'",
+                    m->name, exports->cell[i]->sym);
+        }
+    }
+
+    m->count = exports->count;
+    m->syms = realloc(m->syms, sizeof(char*) * m->count);
+    m->slots = realloc(m->slots, sizeof(int) * m->count);
+    for (int i = 0; i < m->count; ++i) {
+        m->syms[i] = exports->cell[i]->sym;
+        m->slots[i] = lenv_find(m->env, m->syms[i]);
+    }
+    m->ready = 1;
+    return NULL;
+}
+
+lval *builtin_module(lenv *e, lval *a) {
+    LASSERT_NUM("module", a, 3);
+    LASSERT_TYPE("module", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("module", a, 1, LVAL_QEXPR);
+    LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+            "Function 'module' expects a single module name symbol.");
+    LASSERT(a, a->cell[2]->type == LVAL_QEXPR || a->cell[2]->type == LVAL_STR,
+            "Function 'module' passed incorrect type for argument 2. "
+            "Got %s, Expected %s or %s.",
+            ltype_name(a->cell[2]->type), ltype_name(LVAL_QEXPR), ltype_name(LVAL_STR));
+
+    lval *exports = a->cell[1];
+    for (int i = 0; i < exports->count; ++i) {
+        LASSERT(a, exports->cell[i]->type == LVAL_SYM,
+                "Cannot export non-symbol. Got %s, Expected %s.",
+                ltype_name(exports->cell[i]->type), ltype_name(LVAL_SYM));
+    }
+
+    lenv *root = e;
+    while (root->par) root = root->par;
+
+    char *name = a->cell[0]->cell[0]->sym;
+    lmodule *m = lmodule_get(name);
+    if (!m) m = lmodule_new(root, name);
+    m->ready = 0;
+    m->count = 0;
+
+    lval *body = lval_pop(a, 2);
+    if (body->type == LVAL_STR) {
+        lval *x = builtin_load(m->env, lval_add(lval_sexpr(), body));
+        if (x->type == LVAL_ERR) {
+            lval_del(a);
+            return x;
+        }
+        lval_del(x);
+    } else {
+        while (body->count) {
+            lval *x = lval_exec(m->env, lval_pop(body, 0));
+            if (x->type == LVAL_ERR) {
+                lval_del(body);
+                lval_del(a);
+                return x;
+            }
+            lval_del(x);
+        }
+        lval_del(body);
+    }
+
+    lval *err = lmodule_export(m, exports);
+    lval_del(a);
+    return err ? err : lval_sexpr();
+}
+
+lval *builtin_import(lenv *e, lval *a) {
+    LASSERT(a, a->count == 1 || a->count == 2,
+            "Function 'import' passed incorrect no. of arguments. "
+            "Got %i, Expected 1 or 2", a->count);
+    for (int i = 0; i < a->count; ++i) {
+        LASSERT_TYPE("import", a, i, LVAL_QEXPR);
+        for (int j = 0; j < a->cell[i]->count; ++j) {
+            LASSERT(a, a->cell[i]->cell[j]->type == LVAL_SYM,
+                    "Function 'import' passed non-symbol. Got %s, Expected %s.",
+                    ltype_name(a->cell[i]->cell[j]->type), ltype_name(LVAL_SYM));
+        }
+    }
+    LASSERT(a, a->cell[0]->count == 1,
+            "Function 'import' expects a single module name symbol.");
+
+    lmodule *m = lmodule_get(a->cell[0]->cell[0]->sym);
+    LASSERT(a, m, "Unknown module '%s'!", a->cell[0]->cell[0]->sym);
+    LASSERT(a, m->ready, "Module '%s' failed to load!", m->name);
+
+    if (a->count == 2) {
+        for (int j = 0; j < a->cell[1]->count; ++j) {
+            int found = 0;
+            for (int i = 0; i < m->count && !found; ++i) {
+                found = strcmp(a->cell[1]->cell[j]->sym, m->syms[i]) == 0;
+            }
+            LASSERT(a, found, "Module '%s' does not export '%s'!",
+                    m->name, a->cell[1]->cell[j]->sym);
+        }
+    }
+
+    lenv *ns = lenv_namespace(e);
+
+    for (int i = 0; i < m->count; ++i) {
+        lval *k = NULL;
+        if (a->count == 1) {
+            k = lval_sym(m->syms[i]);
+        } else {
+            for (int j = 0; j < a->cell[1]->count; ++j) {
+                if (strcmp(a->cell[1]->cell[j]->sym, m->syms[i]) == 0) {
+                    k = lval_sym(m->syms[i]);
+                    break;
+                }
+            }
+        }
+        if (!k) continue;
+        lenv_put(ns, k, m->env->vals[m->slots[i]]);
+        lval_del(k);
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval *builtin_stack_limit(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("stack-limit", a, 1);
+    LASSERT_TYPE("stack-limit", a, 0, LVAL_NUM);
+    LASSERT(a, a->cell[0]->num > 0 && a->cell[0]->num <= INT32_MAX,
+            "Function 'stack-limit' passed invalid limit %li.", a->cell[0]->num);
+
+    lval *x = lval_num(lvm_frames_max);
+    lvm_frames_max = a->cell[0]->num;
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_step_limit(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("step-limit", a, 1);
+    LASSERT_TYPE("step-limit", a, 0, LVAL_NUM);
+    LASSERT(a, a->cell[0]->num >= 0,
+            "Function 'step-limit' passed invalid limit %li.", a->cell[0]->num);
+
+    lval *x = lval_num(lfuel_step_limit);
+    lfuel_step_limit = a->cell[0]->num;
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_time_limit(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("time-limit", a, 1);
+    LASSERT_TYPE("time-limit", a, 0, LVAL_NUM);
+    LASSERT(a, a->cell[0]->num >= 0,
+            "Function 'time-limit' passed invalid limit %li.", a->cell[0]->num);
+
+    lval *x = lval_num(lfuel_time_limit);
+    lfuel_time_limit = a->cell[0]->num;
+    lval_del(a);
+    return x;
+}
+
+/* Runs the body with at most n steps of the budget in force, and charges
+   the steps it took to that budget */
+lval *builtin_with_budget(lenv *e, lval *a) {
+    LASSERT_NUM("with-budget", a, 2);
+    LASSERT_TYPE("with-budget", a, 0, LVAL_NUM);
+    LASSERT_TYPE("with-budget", a, 1, LVAL_QEXPR);
+    LASSERT(a, a->cell[0]->num >= 0,
+            "Function 'with-budget' passed invalid budget %li.", a->cell[0]->num);
+
+    long fuel = lfuel;
+    long outer = lfuel_left();
+    long n = a->cell[0]->num;
+    if (outer >= 0 && outer < n) n = outer;
+
+    lcode *c = lval_compile_sexpr(e, a->cell[1]);
+    lval_del(a);
+    lfuel = 0;
+    lfuel_budget = n;
+    lval *x = lvm_exec(e, c);
+    lcode_release(c);
+
+    long used = n - lfuel_left();
+    if (outer < 0) {
+        lfuel = fuel;
+        lfuel_budget = -1;
+    } else {
+        lfuel = 0;
+        lfuel_budget = outer - used;
+    }
+    return x;
+}
+
+lval *builtin_memo(lenv *e, lval *a) {
+    (void)e;
+    LASSERT(a, a->count == 1 || a->count == 2,
+            "Function 'memo' passed incorrect no. of arguments. "
+            "Got %i, Expected 1 or 2", a->count);
+    LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+    long capacity = 4096;
+    if (a->count == 2) {
+        LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+        capacity = a->cell[1]->num;
+        LASSERT(a, capacity > 0 && capacity <= INT32_MAX,
+                "Function 'memo' passed invalid capacity %li.", capacity);
+    }
+
+    lval *f = lval_func(builtin_memo);
+    f->memo = lmemo_new(lval_pop(a, 0), capacity);
+    lval_del(a);
+    return f;
+}
+
+lval *builtin_memo_stats(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("memo-stats", a, 1);
+    LASSERT(a, a->cell[0]->type == LVAL_FUN && a->cell[0]->memo,
+            "Function 'memo-stats' passed a function that is not memoized.");
+
+    lmemo *m = a->cell[0]->memo;
+    lval *x = lval_qexpr();
+    lval_add(x, lval_num(m->hits));
+    lval_add(x, lval_num(m->misses));
+    lval_add(x, lval_num(m->evictions));
+    lval_add(x, lval_num(m->count));
+    lval_add(x, lval_num(m->capacity));
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_range(lenv *e, lval *a) {
+    (void)e;
+    LASSERT(a, a->count >= 1 && a->count <= 3,
+            "Function 'range' passed incorrect no. of arguments. "
+            "Got %i, Expected 1 to 3", a->count);
+    for (int i = 0; i < a->count; ++i) LASSERT_TYPE("range", a, i, LVAL_NUM);
+    LASSERT(a, a->count < 3 || a->cell[2]->num != 0,
+            "Function 'range' passed a step of 0.");
+
+    lseq *s = lseq_new(LSEQ_RANGE);
+    s->from = a->cell[0]->num;
+    s->step = a->count == 3 ? a->cell[2]->num : 1;
+    s->to = a->count > 1 ? a->cell[1]->num : s->step > 0 ? LONG_MAX : LONG_MIN;
+    lval_del(a);
+    return lval_seq(s);
+}
+
+lval *builtin_lazy(lval *a, char *func, int kind) {
+    LASSERT_NUM(func, a, 2);
+    lval_type type = kind == LSEQ_TAKE ? LVAL_NUM : LVAL_FUN;
+    LASSERT_TYPE(func, a, 0, type);
+    LASSERT(a, a->cell[1]->type == LVAL_SEQ || a->cell[1]->type == LVAL_QEXPR,
+            "Function '%s' passed incorrect type for argument 1. "
+            "Got %s, Expected %s or %s.", func, ltype_name(a->cell[1]->type),
+            ltype_name(LVAL_SEQ), ltype_name(LVAL_QEXPR));
+
+    lseq *s = lseq_new(kind);
+    if (kind == LSEQ_TAKE) {
+        s->from = a->cell[0]->num;
+    } else {
+        s->func = lval_pop(a, 0);
+    }
+    lval *src = a->cell[a->count - 1];
+    if (src->type == LVAL_SEQ) {
+        s->src = src->seq;
+        lseq_retain(s->src);
+    } else {
+        s->src = lseq_from_list(src);
+    }
+    lval_del(a);
+    return lval_seq(s);
+}
+
+lval *builtin_lmap(lenv *e, lval *a) {
+    (void)e;
+    return builtin_lazy(a, "lmap", LSEQ_MAP);
+}
+
+lval *builtin_lfilter(lenv *e, lval *a) {
+    (void)e;
+    return builtin_lazy(a, "lfilter", LSEQ_FILTER);
+}
+
+lval *builtin_ltake(lenv *e, lval *a) {
+    (void)e;
+    return builtin_lazy(a, "ltake", LSEQ_TAKE);
+}
+
+lval *builtin_generator(lenv *e, lval *a) {
+    (void)e;
+    LASSERT(a, a->count > 0,
+            "Function 'generator' passed incorrect no. of arguments. "
+            "Got 0, Expected at least 1");
+    LASSERT_TYPE("generator", a, 0, LVAL_FUN);
+
+    lseq *s = lseq_new(LSEQ_GEN);
+    s->gen = lgen_new(a);
+    return lval_seq(s);
+}
+
+/* Compiled calls to yield suspend the generator; this is only reached
+   when yield is called some other way */
+lval *builtin_yield(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("yield", a, 1);
+    lval_del(a);
+    return lval_err(lgen_active ? "Cannot yield from inside a builtin call." :
+            "Cannot yield outside of a generator.");
+}
+
+/* Folds as it realizes, dropping each cell once it is passed, so a
+   sequence referenced nowhere else is consumed in constant memory */
+lval *builtin_lfoldl(lenv *e, lval *a) {
+    LASSERT_NUM("lfoldl", a, 3);
+    LASSERT_TYPE("lfoldl", a, 0, LVAL_FUN);
+    LASSERT(a, a->cell[2]->type == LVAL_SEQ || a->cell[2]->type == LVAL_QEXPR,
+            "Function 'lfoldl' passed incorrect type for argument 2. "
+            "Got %s, Expected %s or %s.", ltype_name(a->cell[2]->type),
+            ltype_name(LVAL_SEQ), ltype_name(LVAL_QEXPR));
+
+    lval *f = lval_pop(a, 0);
+    lval *acc = lval_pop(a, 0);
+    lseq *s;
+    if (a->cell[0]->type == LVAL_SEQ) {
+        s = a->cell[0]->seq;
+        lseq_retain(s);
+    } else {
+        s = lseq_from_list(a->cell[0]);
+    }
+    lval_del(a);
+
+    for (;;) {
+        lval *err = lseq_realize(e, s);
+        if (err) {
+            lval_del(acc);
+            acc = err;
+            break;
+        }
+        if (!s->first) break;
+
+        lval *g = lval_copy(f);
+        lval *args = lval_add(lval_sexpr(), acc);
+        acc = lval_call(e, g, lval_add(args, lval_copy(s->first)));
+        lval_del(g);
+        if (acc->type == LVAL_ERR) break;
+
+        lseq *rest = s->rest;
+        lseq_retain(rest);
+        lseq_release(s);
+        s = rest;
+    }
+    lseq_release(s);
+    lval_del(f);
+    return acc;
+}
+
+/* The list library works on cell arrays directly. Like the Lisp it
+   replaces, it evaluates an element before handing it to a function or
+   returning it, the way fst does, and calls functions through the env
+   it was called from. */
+
+/* Calls f with the n values in args, which it consumes. A compiled lambda
+   taking exactly n arguments runs over a fresh env without copying f, as
+   the VM would call it; anything else goes through lval_call. */
+lval *lval_apply(lenv *e, lval *f, lval **args, int n) {
+    if (!f->builtin && !f->memo && lval_compile(e, f)->arity == n && !f->env->count) {
+        for (int i = 0; i < n; ++i) lvm_push(args[i]);
+        lenv *fe = lvm_bind_fixed(f, n);
+        fe->par = e;
+        lval *x = lvm_exec(fe, f->code);
+        lenv_del(fe);
+        return x;
+    }
+
+    lval *a = lval_sexpr();
+    for (int i = 0; i < n; ++i) lval_add(a, args[i]);
+    lval *g = lval_copy(f);
+    lval *x = lval_call(e, g, a);
+    lval_del(g);
+    return x;
+}
+
+/* Frees the list l after its cells before i were moved out */
+void llist_del_from(lval *l, int i) {
+    for (; i < l->count; ++i) lval_del(l->cell[i]);
+    free(l->cell);
+    free(l);
+}
+
+lval *builtin_len(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("len", a, 1);
+    if (a->cell[0]->type == LVAL_VEC) {
+        lval *x = lval_num(lval_vec_len(a->cell[0]));
+        lval_del(a);
+        return x;
+    }
+    LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+    lval *x = lval_num(a->cell[0]->count);
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_nth(lenv *e, lval *a) {
+    LASSERT_NUM("nth", a, 2);
+    LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+    long n = a->cell[0]->num;
+    if (a->cell[1]->type == LVAL_VEC) {
+        LASSERT(a, n >= 0 && n < lval_vec_len(a->cell[1]),
+                "Function 'nth' passed index %li out of range for a vector of %li.",
+                n, lval_vec_len(a->cell[1]));
+        lval *x = lval_copy(lvnode_get(a->cell[1]->vec, n));
+        lval_del(a);
+        return lval_eval(e, x);
+    }
+    LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+    LASSERT(a, n >= 0 && n < a->cell[1]->count,
+            "Function 'nth' passed index %li out of range for a list of %i.",
+            n, a->cell[1]->count);
+    lval *x = lval_pop(a->cell[1], n);
+    lval_del(a);
+    return lval_eval(e, x);
+}
+
+lval *builtin_last(lenv *e, lval *a) {
+    LASSERT_NUM("last", a, 1);
+    if (a->cell[0]->type == LVAL_VEC) {
+        LASSERT(a, a->cell[0]->vec, "Function 'last' passed []!");
+        lval *x = lval_copy(lvnode_get(a->cell[0]->vec, lval_vec_len(a->cell[0]) - 1));
+        lval_del(a);
+        return lval_eval(e, x);
+    }
+    LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+    LASSERT(a, a->cell[0]->count != 0, "Function 'last' passed {}!");
+    lval *x = lval_pop(a->cell[0], a->cell[0]->count - 1);
+    lval_del(a);
+    return lval_eval(e, x);
+}
+
+/* take and drop keep and remove the first n cells of the list */
+lval *llist_split(lval *a, char *func, int keep) {
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_NUM);
+    long n = a->cell[0]->num;
+    if (a->cell[1]->type == LVAL_VEC) {
+        long len = lval_vec_len(a->cell[1]);
+        LASSERT(a, n >= 0 && n <= len,
+                "Function '%s' passed count %li out of range for a vector of %li.",
+                func, n, len);
+        lval *x = lval_vec(keep ? lvnode_slice(a->cell[1]->vec, 0, n)
+                : lvnode_slice(a->cell[1]->vec, n, len));
+        lval_del(a);
+        return x;
+    }
+    LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+    lval *l = a->cell[1];
+    LASSERT(a, n >= 0 && n <= l->count,
+            "Function '%s' passed count %li out of range for a list of %i.",
+            func, n, l->count);
+
+    l = lval_take(a, 1);
+    if (keep) {
+        for (int i = n; i < l->count; ++i) lval_del(l->cell[i]);
+    } else {
+        for (int i = 0; i < n; ++i) lval_del(l->cell[i]);
+        memmove(&l->cell[0], &l->cell[n], sizeof(lval*) * (l->count - n));
+    }
+    l->count = keep ? n : l->count - n;
+    return l;
+}
+
+lval *builtin_take(lenv *e, lval *a) {
+    (void)e;
+    return llist_split(a, "take", 1);
+}
+
+lval *builtin_drop(lenv *e, lval *a) {
+    (void)e;
+    return llist_split(a, "drop", 0);
+}
+
+lval *builtin_vec(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("vec", a, 1);
+    LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+    return lval_vec(lvnode_build(lval_take(a, 0)));
+}
+
+lval *builtin_vec_list(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("vec-list", a, 1);
+    LASSERT_TYPE("vec-list", a, 0, LVAL_VEC);
+    lval *x = lval_vec_list(a->cell[0]);
+    lval_del(a);
+    return x;
+}
+
+/* (vec-set n v x) is v with element n replaced by x */
+lval *builtin_vec_set(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("vec-set", a, 3);
+    LASSERT_TYPE("vec-set", a, 0, LVAL_NUM);
+    LASSERT_TYPE("vec-set", a, 1, LVAL_VEC);
+    long n = a->cell[0]->num;
+    LASSERT(a, n >= 0 && n < lval_vec_len(a->cell[1]),
+            "Function 'vec-set' passed index %li out of range for a vector of %li.",
+            n, lval_vec_len(a->cell[1]));
+    lval *x = lval_vec(lvnode_set(a->cell[1]->vec, n, lval_pop(a, 2)));
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_elem(lenv *e, lval *a) {
+    LASSERT_NUM("elem", a, 2);
+    LASSERT_TYPE("elem", a, 1, LVAL_QEXPR);
+    lval *l = a->cell[1];
+    int found = 0;
+    for (int i = 0; i < l->count && !found; ++i) {
+        lval *x = lval_eval(e, lval_copy(l->cell[i]));
+        if (x->type == LVAL_ERR) {
+            lval_del(a);
+            return x;
+        }
+        found = lval_eq(a->cell[0], x);
+        lval_del(x);
+    }
+    lval_del(a);
+    return lval_num(found);
+}
+
+/* Each result takes the place of the element it came from */
+lval *builtin_map(lenv *e, lval *a) {
+    LASSERT_NUM("map", a, 2);
+    LASSERT_TYPE("map", a, 0, LVAL_FUN);
+    LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+    lval *l = lval_pop(a, 1);
+    lval *f = lval_take(a, 0);
+
+    for (int i = 0; i < l->count; ++i) {
+        lval *x = lval_eval(e, l->cell[i]);
+        if (x->type != LVAL_ERR) x = lval_apply(e, f, &x, 1);
+        l->cell[i] = x;
+        if (x->type == LVAL_ERR) {
+            l->cell[i] = lval_sexpr();
+            lval_del(l);
+            l = x;
+            break;
+        }
+    }
+    lval_del(f);
+    return l;
+}
+
+/* The elements kept are moved down over those dropped */
+lval *builtin_filter(lenv *e, lval *a) {
+    LASSERT_NUM("filter", a, 2);
+    LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+    LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+    lval *l = lval_pop(a, 1);
+    lval *f = lval_take(a, 0);
+
+    int kept = 0;
+    for (int i = 0; i < l->count; ++i) {
+        lval *x = lval_eval(e, lval_copy(l->cell[i]));
+        if (x->type != LVAL_ERR) x = lval_apply(e, f, &x, 1);
+        if (x->type != LVAL_NUM) {
+            if (x->type != LVAL_ERR) {
+                lval *err = lval_err("Function 'filter' passed a predicate that returned %s, "
+                        "Expected %s.", ltype_name(x->type), ltype_name(LVAL_NUM));
+                lval_del(x);
+                x = err;
+            }
+            for (int j = 0; j < kept; ++j) lval_del(l->cell[j]);
+            llist_del_from(l, i);
+            lval_del(f);
+            return x;
+        }
+        if (x->num) {
+            l->cell[kept++] = l->cell[i];
+        } else {
+            lval_del(l->cell[i]);
+        }
+        lval_del(x);
+    }
+    l->count = kept;
+    lval_del(f);
+    return l;
+}
+
+/* Folds the elements of l into acc; both are consumed. Arithmetic
+   builtins applied to two numbers are run without building a call. */
+lval *llist_fold(lenv *e, lval *f, lval *acc, lval *l) {
+    int op = f->builtin && !f->memo ? lcomp_arith(f->builtin) : 0;
+    for (int i = 0; i < l->count; ++i) {
+        lval *args[2] = { acc, lval_eval(e, l->cell[i]) };
+        if (args[1]->type == LVAL_ERR) {
+            lval_del(acc);
+            llist_del_from(l, i + 1);
+            return args[1];
+        }
+        if (op && acc->type == LVAL_NUM && args[1]->type == LVAL_NUM) {
+            long r;
+            if (lnum_op(op, acc->num, args[1]->num, &r)) {
+                acc = lnum_err(args[1]->num);
+                lval_del(args[0]);
+            } else {
+                acc->num = r;
+            }
+            lval_del(args[1]);
+        } else {
+            acc = lval_apply(e, f, args, 2);
+        }
+        if (acc->type == LVAL_ERR) {
+            llist_del_from(l, i + 1);
+            return acc;
+        }
+    }
+    llist_del_from(l, l->count);
+    return acc;
+}
+
+lval *builtin_foldl(lenv *e, lval *a) {
+    LASSERT_NUM("foldl", a, 3);
+    LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+    LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+    lval *l = lval_pop(a, 2);
+    lval *acc = lval_pop(a, 1);
+    lval *f = lval_take(a, 0);
+    lval *x = llist_fold(e, f, acc, l);
+    lval_del(f);
+    return x;
+}
+
+/* sum and product fold with whatever + and * are bound to where they are
+   called */
+lval *llist_reduce(lenv *e, lval *a, char *func, char *op, long z) {
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+    lval *k = lval_sym(op);
+    lval *f = lenv_get(e, k);
+    lval_del(k);
+    if (f->type != LVAL_FUN) {
+        lval_del(a);
+        if (f->type == LVAL_ERR) return f;
+        lval_del(f);
+        return lval_err("S-expression does not start with function");
+    }
+    lval *x = llist_fold(e, f, lval_num(z), lval_take(a, 0));
+    lval_del(f);
+    return x;
+}
+
+lval *builtin_sum(lenv *e, lval *a) {
+    return llist_reduce(e, a, "sum", "+", 0);
+}
+
+lval *builtin_product(lenv *e, lval *a) {
+    return llist_reduce(e, a, "product", "*", 1);
+}
+
+/* unpack evaluates f applied to the elements as an S-Expression, so the
+   elements are evaluated too; apply passes its arguments as they are */
+lval *builtin_unpack(lenv *e, lval *a) {
+    LASSERT_NUM("unpack", a, 2);
+    LASSERT_TYPE("unpack", a, 1, LVAL_QEXPR);
+    lval *l = lval_pop(a, 1);
+    lval *x = lval_join(a, l);
+    return lval_eval(e, x);
+}
+
+lval *builtin_pack(lenv *e, lval *a) {
+    LASSERT(a, a->count > 0,
+            "Function 'pack' passed incorrect no. of arguments. "
+            "Got %i, Expected at least %i.", a->count, 1);
+    LASSERT_TYPE("pack", a, 0, LVAL_FUN);
+    lval *f = lval_pop(a, 0);
+    a->type = LVAL_QEXPR;
+    lval *x = lval_apply(e, f, &a, 1);
+    lval_del(f);
+    return x;
+}
+
+lval *builtin_apply(lenv *e, lval *a) {
+    LASSERT(a, a->count > 1,
+            "Function 'apply' passed incorrect no. of arguments. "
+            "Got %i, Expected at least %i.", a->count, 2);
+    LASSERT_TYPE("apply", a, 0, LVAL_FUN);
+    LASSERT_TYPE("apply", a, a->count - 1, LVAL_QEXPR);
+    lval *f = lval_pop(a, 0);
+    a = lval_join(a, lval_pop(a, a->count - 1));
+    lval *x = lval_apply(e, f, a->cell, a->count);
+    free(a->cell);
+    free(a);
+    lval_del(f);
+    return x;
+}
+
+/* The loops compile their bodies once and run them as a frame per
+   iteration over the same scope, whose first binding is the loop
+   variable. Rebinding it in the body does not change the iteration. */
+lval *lloop_body(lenv *scope, lcode *c) {
+    lval *x = lvm_exec(scope, c);
+    if (x->type == LVAL_ERR) return x;
+    lval_del(x);
+    return NULL;
+}
+
+/* Sets the loop variable to n, in place while it still holds a number */
+void lloop_set_num(lenv *scope, long n) {
+    if (scope->vals[0]->type != LVAL_NUM) {
+        lval_del(scope->vals[0]);
+        scope->vals[0] = lval_num(0);
+    }
+    scope->vals[0]->num = n;
+}
+
+lenv *lloop_scope(lenv *e, lval *var) {
+    lenv *scope = lenv_new();
+    scope->par = e;
+    scope->loop = 1;
+    lval *zero = lval_num(0);
+    lenv_put(scope, var, zero);
+    lval_del(zero);
+    return scope;
+}
+
+lval *builtin_while(lenv *e, lval *a) {
+    LASSERT_NUM("while", a, 2);
+    LASSERT_TYPE("while", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("while", a, 1, LVAL_QEXPR);
+
+    lcode *cond = lval_compile_sexpr(e, a->cell[0]);
+    lcode *body = lval_compile_sexpr(e, a->cell[1]);
+    lval *x = NULL;
+    for (;;) {
+        lval *c = lvm_exec(e, cond);
+        if (c->type != LVAL_NUM) {
+            x = c->type == LVAL_ERR ? c : lval_err(
+                    "Function '%s' passed incorrect type for argument %i. "
+                    "Got %s, Expected %s.",
+                    "while", 0, ltype_name(c->type), ltype_name(LVAL_NUM));
+            if (x != c) lval_del(c);
+            break;
+        }
+        int done = c->num == 0;
+        lval_del(c);
+        if (done || (x = lloop_body(e, body))) break;
+    }
+    lcode_release(cond);
+    lcode_release(body);
+    lval_del(a);
+    return x ? x : lval_sexpr();
+}
+
+lval *lloop_range(lenv *e, lval *a, long from, long to) {
+    lval *body = a->cell[a->count - 1];
+    lenv *scope = lloop_scope(e, a->cell[0]->cell[0]);
+    lcode *c = lval_compile_sexpr(scope, body);
+    lval *x = NULL;
+    for (long n = from; n < to; ++n) {
+        lloop_set_num(scope, n);
+        if ((x = lloop_body(scope, c))) break;
+    }
+    lcode_release(c);
+    lenv_del(scope);
+    lval_del(a);
+    return x ? x : lval_sexpr();
+}
+
+/* The loop variable of a loop, as in {i} */
+#define LASSERT_LOOP_VAR(func, a) \
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR); \
+    LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM, \
+            "Function '%s' passed invalid loop variable. Expected a single symbol.", func)
+
+lval *builtin_dotimes(lenv *e, lval *a) {
+    LASSERT_NUM("dotimes", a, 3);
+    LASSERT_LOOP_VAR("dotimes", a);
+    LASSERT_TYPE("dotimes", a, 1, LVAL_NUM);
+    LASSERT_TYPE("dotimes", a, 2, LVAL_QEXPR);
+    return lloop_range(e, a, 0, a->cell[1]->num);
+}
+
+lval *builtin_for_range(lenv *e, lval *a) {
+    LASSERT_NUM("for-range", a, 4);
+    LASSERT_LOOP_VAR("for-range", a);
+    LASSERT_TYPE("for-range", a, 1, LVAL_NUM);
+    LASSERT_TYPE("for-range", a, 2, LVAL_NUM);
+    LASSERT_TYPE("for-range", a, 3, LVAL_QEXPR);
+    return lloop_range(e, a, a->cell[1]->num, a->cell[2]->num);
+}
+
+/* each swaps the elements of a Q-Expression, which it owns, into the loop
+   variable rather than copying them, and copies those of a Sequence as
+   they are realized */
+lval *builtin_each(lenv *e, lval *a) {
+    LASSERT_NUM("each", a, 3);
+    LASSERT_LOOP_VAR("each", a);
+    LASSERT(a, a->cell[1]->type == LVAL_SEQ || a->cell[1]->type == LVAL_QEXPR,
+            "Function 'each' passed incorrect type for argument 1. "
+            "Got %s, Expected %s or %s.", ltype_name(a->cell[1]->type),
+            ltype_name(LVAL_SEQ), ltype_name(LVAL_QEXPR));
+    LASSERT_TYPE("each", a, 2, LVAL_QEXPR);
+
+    lenv *scope = lloop_scope(e, a->cell[0]->cell[0]);
+    lcode *c = lval_compile_sexpr(scope, a->cell[2]);
+    lval *l = a->cell[1];
+    lval *x = NULL;
+    if (l->type == LVAL_QEXPR) {
+        for (int i = 0; i < l->count && !x; ++i) {
+            lval *v = l->cell[i];
+            l->cell[i] = scope->vals[0];
+            scope->vals[0] = v;
+            x = lloop_body(scope, c);
+        }
+    } else {
+        lseq *s = l->seq;
+        lseq_retain(s);
+        while (!(x = lseq_realize(e, s)) && s->first) {
+            lval_del(scope->vals[0]);
+            scope->vals[0] = lval_copy(s->first);
+            if ((x = lloop_body(scope, c))) break;
+            lseq *rest = s->rest;
+            lseq_retain(rest);
+            lseq_release(s);
+            s = rest;
+        }
+        lseq_release(s);
+    }
+    lcode_release(c);
+    lenv_del(scope);
+    lval_del(a);
+    return x ? x : lval_sexpr();
+}
+
+lval *builtin_force(lenv *e, lval *a) {
+    LASSERT_NUM("force", a, 1);
+    LASSERT_TYPE("force", a, 0, LVAL_SEQ);
+
+    lval *x = lval_qexpr();
+    for (lseq *s = a->cell[0]->seq; ; s = s->rest) {
+        lval *err = lseq_realize(e, s);
+        if (err) {
+            lval_del(x);
+            x = err;
+            break;
+        }
+        if (!s->first) break;
+        lval_add(x, lval_copy(s->first));
+    }
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_try(lenv *e, lval *a) {
+    LASSERT_NUM("try", a, 2);
+    LASSERT_TYPE("try", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("try", a, 1, LVAL_QEXPR);
+
+    lval *body = lval_pop(a, 0);
+    body->type = LVAL_SEXPR;
+    lval *x = lval_eval(e, body);
+    if (x->type != LVAL_ERR) {
+        lval_del(a);
+        return x;
+    }
+
+    lenv *scope = lenv_new();
+    scope->par = e;
+    lval *k = lval_sym("err");
+    lval *msg = lval_str(x->err);
+    lenv_put(scope, k, msg);
+    lval_del(k);
+    lval_del(msg);
+    lval_del(x);
+
+    lval *handler = lval_take(a, 0);
+    handler->type = LVAL_SEXPR;
+    x = lval_eval(scope, handler);
+    lenv_del(scope);
+    return x;
+}
+
+lval *builtin_jit(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("jit", a, 1);
+    LASSERT_TYPE("jit", a, 0, LVAL_NUM);
+
+    lval *x = lval_num(ljit_enabled);
+#ifdef LJIT
+    ljit_enabled = a->cell[0]->num != 0;
+#endif
+    lval_del(a);
+    return x;
+}
+
+/* Writes the raw machine code of a compiled function, which
+   objdump -D -b binary -m i386:x86-64 can disassemble */
+lval *builtin_jit_dump(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("jit-dump", a, 2);
+    LASSERT_TYPE("jit-dump", a, 0, LVAL_FUN);
+    LASSERT_TYPE("jit-dump", a, 1, LVAL_STR);
+
+    lcode *c = a->cell[0]->builtin ? NULL : a->cell[0]->code;
+    LASSERT(a, c && c->native,
+            "Function 'jit-dump' passed a function with no machine code.");
+
+    FILE *f = fopen(a->cell[1]->str, "wb");
+    LASSERT(a, f, "Could not open file %s", a->cell[1]->str);
+    fwrite(c->native, 1, c->native_size, f);
+    fclose(f);
+
+    lval *x = lval_num(c->native_size);
+    lval_del(a);
+    return x;
+}
+
+lval *builtin_error(lenv *e, lval *a) {
+    (void)e;
+    LASSERT_NUM("error", a, 1);
+    LASSERT_TYPE("error", a, 0, LVAL_STR);
+
+    lval *err = lval_err(a->cell[0]->str);
+    lval_del(a);
+
+    return err;
+}
+
+lval *builtin_print(lenv *e, lval *a) {
+    (void)e;
+    for (int i = 0; i < a->count; ++i) {
+        lval_print(a->cell[i]);
+        putchar(' ');
+    }
+
+    putchar('\n');
+    lval_del(a);
+
+    return lval_sexpr();
+}
+
+void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
     lval *k = lval_sym(name);
     lval *v = lval_func(func);
 
@@ -933,13 +6369,69 @@ void lenv_add_builtins(lenv *e) {
     lenv_add_builtin(e, "tail", builtin_tail);
     lenv_add_builtin(e, "eval", builtin_eval);
     lenv_add_builtin(e, "join", builtin_join);
+    lenv_add_builtin(e, "len", builtin_len);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "last", builtin_last);
+    lenv_add_builtin(e, "take", builtin_take);
+    lenv_add_builtin(e, "drop", builtin_drop);
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "vec-list", builtin_vec_list);
+    lenv_add_builtin(e, "vec-set", builtin_vec_set);
+    lenv_add_builtin(e, "elem", builtin_elem);
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "foldl", builtin_foldl);
+    lenv_add_builtin(e, "sum", builtin_sum);
+    lenv_add_builtin(e, "product", builtin_product);
+    lenv_add_builtin(e, "unpack", builtin_unpack);
+    lenv_add_builtin(e, "pack", builtin_pack);
+    lenv_add_builtin(e, "apply", builtin_apply);
+    lenv_add_builtin(e, "quasiquote", builtin_quasiquote);
+    lenv_add_builtin(e, "unquote", builtin_unquote);
+    lenv_add_builtin(e, "unquote-splicing", builtin_unquote_splicing);
     lenv_add_builtin(e, "def", builtin_def);
+    lenv_add_builtin(e, "=", builtin_put);
+    lenv_add_builtin(e, "set!", builtin_set);
+    lenv_add_builtin(e, "box", builtin_box);
+    lenv_add_builtin(e, "unbox", builtin_unbox);
+    lenv_add_builtin(e, "set-box!", builtin_set_box);
     lenv_add_builtin(e, "load", builtin_load);
+    lenv_add_builtin(e, "module", builtin_module);
+    lenv_add_builtin(e, "import", builtin_import);
     lenv_add_builtin(e, "print", builtin_print);
     lenv_add_builtin(e, "error", builtin_error);
+    lenv_add_builtin(e, "stack-limit", builtin_stack_limit);
+    lenv_add_builtin(e, "step-limit", builtin_step_limit);
+    lenv_add_builtin(e, "time-limit", builtin_time_limit);
+    lenv_add_builtin(e, "with-budget", builtin_with_budget);
+    lenv_add_builtin(e, "try", builtin_try);
+    lenv_add_builtin(e, "memo", builtin_memo);
+    lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+    lenv_add_builtin(e, "range", builtin_range);
+    lenv_add_builtin(e, "lmap", builtin_lmap);
+    lenv_add_builtin(e, "lfilter", builtin_lfilter);
+    lenv_add_builtin(e, "ltake", builtin_ltake);
+    lenv_add_builtin(e, "force", builtin_force);
+    lenv_add_builtin(e, "generator", builtin_generator);
+    lenv_add_builtin(e, "yield", builtin_yield);
+    lenv_add_builtin(e, "lfoldl", builtin_lfoldl);
+    lenv_add_builtin(e, "jit", builtin_jit);
+    lenv_add_builtin(e, "jit-dump", builtin_jit_dump);
     lenv_add_builtin(e, "\\", builtin_lambda);
+    lenv_add_builtin(e, "defmacro", builtin_defmacro);
+    lenv_add_builtin(e, "gensym", builtin_gensym);
 
     lenv_add_builtin(e, "if", builtin_if);
+    lenv_add_builtin(e, "do", builtin_do);
+    lenv_add_builtin(e, "select", builtin_select);
+    lenv_add_builtin(e, "match", builtin_match);
+    lenv_add_builtin(e, "while", builtin_while);
+    lenv_add_builtin(e, "dotimes", builtin_dotimes);
+    lenv_add_builtin(e, "for-range", builtin_for_range);
+    lenv_add_builtin(e, "each", builtin_each);
+    lenv_add_builtin(e, "let", builtin_let);
+    lenv_add_builtin(e, "and", builtin_and);
+    lenv_add_builtin(e, "or", builtin_or);
     lenv_add_builtin(e, ">", builtin_gt);
     lenv_add_builtin(e, "<", builtin_lt);
     lenv_add_builtin(e, ">=", builtin_ge);
@@ -951,6 +6443,10 @@ void lenv_add_builtins(lenv *e) {
     lenv_add_builtin(e, "-", builtin_sub);
     lenv_add_builtin(e, "*", builtin_mul);
     lenv_add_builtin(e, "/", builtin_div);
+    lenv_add_builtin(e, "%", builtin_mod);
+    lenv_add_builtin(e, "min", builtin_min);
+    lenv_add_builtin(e, "max", builtin_max);
+    lenv_add_builtin(e, "abs", builtin_abs);
 }
 
 void load_file(lenv *e, char *file) {
@@ -961,9 +6457,125 @@ void load_file(lenv *e, char *file) {
     lval_del(x);
 }
 
+/* Ahead-of-time compilation writes the forms of stdlib.lisp and a program
+   out as C that rebuilds them, so the executable skips reading and parsing.
+   It includes this file built with MYLISP_AOT, whose main runs the forms
+   in place of the REPL. */
+#ifdef MYLISP_AOT
+extern lval *(*aot_forms[])(void);
+extern int aot_forms_count;
+#endif
+
+void aot_emit_str(FILE *f, char *s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\' || c < ' ' || c > '~') {
+            fprintf(f, "\\%03o", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+int aot_emit(FILE *f, lval *v, int *n) {
+    int x = (*n)++;
+    fprintf(f, "    lval *v%i = ", x);
+    switch (v->type) {
+        case LVAL_NUM:
+            fprintf(f, "lval_num((long)0x%lxUL);\n", (unsigned long)v->num);
+            break;
+        case LVAL_ERR:
+            fprintf(f, "lval_err(\"%%s\", ");
+            aot_emit_str(f, v->err);
+            fprintf(f, ");\n");
+            break;
+        case LVAL_SYM:
+        case LVAL_STR:
+            fprintf(f, v->type == LVAL_SYM ? "lval_sym(" : "lval_str(");
+            aot_emit_str(f, v->type == LVAL_SYM ? v->sym : v->str);
+            fprintf(f, ");\n");
+            break;
+        default:
+            fprintf(f, v->type == LVAL_QEXPR ? "lval_qexpr();\n" : "lval_sexpr();\n");
+            for (int i = 0; i < v->count; ++i) {
+                int y = aot_emit(f, v->cell[i], n);
+                fprintf(f, "    lval_add(v%i, v%i);\n", x, y);
+            }
+            break;
+    }
+    return x;
+}
+
+int aot_compile(char *in, char *out) {
+    char *files[] = { MYLISP_HOME "/stdlib.lisp", in };
+    int forms = 0;
+
+    char *src = malloc(strlen(out) + 3);
+    sprintf(src, "%s.c", out);
+    FILE *f = fopen(src, "w");
+    if (!f) {
+        fprintf(stderr, "Could not open file %s\n", src);
+        free(src);
+        return 1;
+    }
+    fprintf(f, "#include \"%s/mylisp.c\"\n\n", MYLISP_HOME);
+
+    for (int i = 0; i < 2; ++i) {
+        mpc_result_t r;
+        if (!mpc_parse_contents(files[i], Lispy, &r)) {
+            mpc_err_print(r.error);
+            mpc_err_delete(r.error);
+            fclose(f);
+            remove(src);
+            free(src);
+            return 1;
+        }
+        lval *expr = lval_read(r.output);
+        mpc_ast_delete(r.output);
+
+        for (int j = 0; j < expr->count; ++j) {
+            int n = 0;
+            fprintf(f, "lval *aot_form_%i(void) {\n", forms++);
+            aot_emit(f, expr->cell[j], &n);
+            fprintf(f, "    return v0;\n}\n\n");
+        }
+        lval_del(expr);
+    }
+
+    fprintf(f, "lval *(*aot_forms[])(void) = {\n");
+    for (int i = 0; i < forms; ++i) fprintf(f, "    aot_form_%i,\n", i);
+    fprintf(f, "};\n\nint aot_forms_count = %i;\n", forms);
+    fclose(f);
+
+    /* gcc gets its arguments directly, so no path needs shell quoting */
+    char *argv[] = { "gcc", "-O2", "-DMYLISP_AOT", "-o", out, src,
+        MYLISP_HOME "/mpc/mpc.c", "-lreadline", NULL };
+    int status = -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if (pid > 0) waitpid(pid, &status, 0);
+    remove(src);
+    free(src);
+    return status == 0 ? 0 : 1;
+}
+
 int main(int argc, char **argv) {
-    printf("Mylisp version 0.0.0\n");
-    printf("Press Ctrl-c to Exit\n");
+    char stack_base;
+    struct rlimit rl;
+    lstack_base = (uintptr_t)&stack_base;
+    lstack_size = 8 << 20;
+    if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        lstack_size = rl.rlim_cur;
+    }
+    lstack_size -= lstack_size / 8;
+
+    char *jit = getenv("MYLISP_JIT");
+    if (jit && strcmp(jit, "0") == 0) ljit_enabled = 0;
 
     Number = mpc_new("number");
     String = mpc_new("string");
@@ -971,6 +6583,8 @@ int main(int argc, char **argv) {
     Symbol = mpc_new("symbol");
     Sexpr = mpc_new("sexpr");
     Qexpr = mpc_new("qexpr");
+    Quasi = mpc_new("quasi");
+    Unquote = mpc_new("unquote");
     Expr = mpc_new("expr");
     Lispy = mpc_new("lispy");
 
@@ -979,17 +6593,46 @@ int main(int argc, char **argv) {
        number   : /-?[0-9]+/; \
        string   : /\"(\\\\.|[^\"])*\"/; \
        comment  : /;[^\\r\\n]*/; \
-       symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
+       symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+#?/ ; \
        sexpr    : '(' <expr>* ')' ; \
        qexpr    : '{' <expr>* '}' ; \
-       expr     : <number> | <string> | <comment> | <symbol> | <sexpr> | <qexpr> ; \
+       quasi    : '`' (<sexpr> | <qexpr>) ; \
+       unquote  : (\",@\" | ',') <expr> ; \
+       expr     : <number> | <string> | <comment> | <symbol> | <sexpr> | <qexpr> \
+                | <quasi> | <unquote> ; \
        lispy    : /^/ <expr>* /$/ ; \
-      ", Number, String, Comment, Symbol, Sexpr, Qexpr, Expr, Lispy);
+      ", Number, String, Comment, Symbol, Sexpr, Qexpr, Quasi, Unquote, Expr, Lispy);
+
+    if (argc > 1 && strcmp(argv[1], "--compile") == 0) {
+        int status = 1;
+        if (argc == 5 && strcmp(argv[3], "-o") == 0) {
+            status = aot_compile(argv[2], argv[4]);
+        } else {
+            fprintf(stderr, "Usage: %s --compile prog.lisp -o prog\n", argv[0]);
+        }
+        mpc_cleanup(10, Number, String, Comment, Symbol, Sexpr, Qexpr, Quasi, Unquote, Expr, Lispy);
+        for (int i = 0; i < lsyms_size; ++i) free(lsyms[i]);
+        free(lsyms);
+        return status;
+    }
 
     lenv *e = lenv_new();
+    lroot = e;
     lenv_add_builtins(e);
 
-    load_file(e, "stdlib.lisp");
+#ifdef MYLISP_AOT
+    (void)argc;
+    (void)argv;
+    for (int i = 0; i < aot_forms_count; ++i) {
+        lval *x = lval_exec(e, aot_forms[i]());
+        if (x->type == LVAL_ERR) lval_println(x);
+        lval_del(x);
+    }
+#else
+    printf("Mylisp version 0.0.0\n");
+    printf("Press Ctrl-c to Exit\n");
+
+    load_file(e, MYLISP_HOME "/stdlib.lisp");
 
     for (int i = 1; i < argc; ++i) {
         load_file(e, argv[i]);
@@ -1004,7 +6647,7 @@ int main(int argc, char **argv) {
         if (*input) add_history(input);
         mpc_result_t r;
         if (mpc_parse("<stdin>", input, Lispy, &r)) {
-            lval *x = lval_eval(e, lval_read(r.output));
+            lval *x = lval_exec(e, lval_read(r.output));
             lval_println(x);
             lval_del(x);
             mpc_ast_delete(r.output);
@@ -1014,9 +6657,14 @@ int main(int argc, char **argv) {
         }
         free(input);
     }
+#endif
 
-    mpc_cleanup(8, Number, String, Comment, Symbol, Sexpr, Qexpr, Expr, Lispy);
+    mpc_cleanup(10, Number, String, Comment, Symbol, Sexpr, Qexpr, Quasi, Unquote, Expr, Lispy);
+    for (int i = 0; i < modules_count; ++i) lmodule_del(modules[i]);
+    free(modules);
     lenv_del(e);
+    for (int i = 0; i < lsyms_size; ++i) free(lsyms[i]);
+    free(lsyms);
 
     return 0;
 }
@@ -0,0 +1,113 @@
+; Regression tests, run by make test. Each check prints "ok" or "FAIL";
+; try turns an error into its message so that it fails the check too.
+
+(fun {expect name got want} {
+  if (== got want)
+    {print "ok" name}
+    {print "FAIL" name got want}
+})
+
+; Inlining a lambda removes its frame, so a body that runs code looking up
+; its formals dynamically must not be inlined
+(def {inc-n} {+ n 1})
+(fun {if-global n} {if 1 inc-n {0}})
+(expect "inline if with a global branch" (try {if-global 5} {err}) 6)
+
+(def {inc-x} {+ x 1})
+(fun {eval-global x} {eval inc-x})
+(expect "inline eval of a global" (try {eval-global 5} {err}) 6)
+
+; A macro's t# temporaries are renamed in each expansion, so they cannot
+; capture the caller's names
+(defmacro {twice e} {`(do (= {v#} ,e) (+ v# v#))})
+(fun {twice-plus v} {+ (twice 10) v})
+(expect "macro temporaries" (try {twice-plus 1} {err}) 21)
+
+; = in a loop body binds in the frame around the loop, as in while
+(fun {sum-dotimes k} {do (= {s} 0) (dotimes {i} k {= {s} (+ s i)}) s})
+(expect "= in dotimes" (try {sum-dotimes 5} {err}) 10)
+(fun {sum-range a b} {do (= {s} 0) (for-range {i} a b {= {s} (+ s i)}) s})
+(expect "= in for-range" (try {sum-range 2 5} {err}) 9)
+(fun {sum-each l} {do (= {s} 0) (each {x} l {= {s} (+ s x)}) s})
+(expect "= in each" (try {sum-each {1 2 3}} {err}) 6)
+(fun {sum-while k} {do (= {s} 0) (= {i} 0) (while {< i k} {do (= {s} (+ s i)) (= {i} (+ i 1))}) s})
+(expect "= in while" (try {sum-while 5} {err}) 10)
+
+; Builtins calling a function they are passed give it the caller's
+; dynamic scope, so a body calling them is not inlined either
+(def {add-x} (\ {y} {+ x y}))
+(fun {map-x x} {map add-x {1 2}})
+(expect "inline map with a callback" (try {map-x 10} {err}) {11 12})
+(fun {apply-x x} {apply add-x {1}})
+(expect "inline apply with a callback" (try {apply-x 7} {err}) 8)
+(fun {unpack-x x} {unpack add-x {2}})
+(expect "inline unpack with a callback" (try {unpack-x 7} {err}) 9)
+
+; A loop in tail position still binds = in its own function's frame, not
+; in the caller's or the global env, even when a formal shares the name of
+; the loop variable
+(fun {tail-dotimes i} {dotimes {i} 2 {= {dotimes-leak} 5}})
+(tail-dotimes 0)
+(expect "= in a tail dotimes stays local" (try {dotimes-leak} {err})
+  "Unbound symbol 'dotimes-leak'!")
+(fun {tail-each x} {each {x} {1 2} {= {each-leak} x}})
+(fun {each-caller z} {do (tail-each 0) each-leak})
+(expect "= in a tail each stays local" (try {each-caller 1} {err})
+  "Unbound symbol 'each-leak'!")
+
+; Realizing a lazy sequence burns steps, so a budget stops an endless one
+(expect "budget stops an endless lfoldl"
+  (try {with-budget 1000 {lfoldl + 0 (range 0)}} {err}) "Evaluation budget exceeded")
+(expect "budget stops an endless force"
+  (try {with-budget 1000 {force (lmap - (range 0))}} {err}) "Evaluation budget exceeded")
+
+; Tail calls replace their frame, so they run deeper than the frame limit
+; through if, do and select, while a call that is not a tail call does not
+(def {frames} (stack-limit 200))
+(fun {count-if n} {if (== n 0) {0} {count-if (- n 1)}})
+(expect "tail call through if" (try {count-if 100000} {err}) 0)
+(fun {count-do n} {do (= {m} (- n 1)) (if (< m 0) {0} {count-do m})})
+(expect "tail call through do" (try {count-do 100000} {err}) 0)
+(fun {count-select n} {select {(== n 0) 0} {otherwise (count-select (- n 1))}})
+(expect "tail call through select" (try {count-select 100000} {err}) 0)
+(fun {even n} {if (== n 0) {1} {odd (- n 1)}})
+(fun {odd n} {if (== n 0) {0} {even (- n 1)}})
+(expect "mutual tail calls" (try {even 100001} {err}) 0)
+(fun {depth n} {if (== n 0) {0} {+ 1 (depth (- n 1))}})
+(expect "frame limit without tail calls" (try {depth 1000} {err}) "stack limit exceeded")
+
+; A tail call keeps the caller's env while the callee does not shadow all
+; of its names, so the callee still sees the rest through dynamic scope
+(fun {add-y x} {+ x y})
+(fun {call-add-y x y} {add-y (* x 10)})
+(expect "tail call shadowing some formals" (try {call-add-y 1 2} {err}) 12)
+(fun {count-base n acc} {if (== n 0) {+ acc base} {count-base (- n 1) (+ acc 1)}})
+(fun {call-count-base n base} {count-base n 0})
+(expect "deep tail calls under a partly shadowed caller"
+  (try {call-count-base 100000 7} {err}) 100007)
+(stack-limit frames)
+
+; Machine code gives the same results and errors as the interpreter. Each
+; case runs first with the JIT off, then hot enough to be compiled.
+(def {jit-was} (jit 1))
+(def {has-jit} (jit 1))
+(fun {same-jit label code} {do
+  (jit 0) (= {interp} (try code {err}))
+  (jit 1) (= {native} (try code {err}))
+  (expect label native interp)})
+(fun {jsum n acc} {if (== n 0) {acc} {jsum (- n 1) (+ acc n)}})
+(same-jit "jit tail recursion" {jsum 10000 0})
+(fun {jmix n acc} {if (== n 0) {acc} {jmix (- n 1) (+ (- acc (% n 7)) (/ (* n 3) 2))}})
+(same-jit "jit arithmetic" {jmix 10000 5})
+(fun {jdouble n acc} {if (== n 0) {acc} {jdouble (- n 1) (* acc 2)}})
+(same-jit "jit overflow" {jdouble 100 1})
+(fun {jneg n acc} {if (== n 0) {acc} {jneg (- n 1) (- acc 1)}})
+(same-jit "jit subtraction overflow" {jneg 1000 -9223372036854775000})
+(fun {jdiv n} {if (== n -1) {0} {+ (/ 100 n) (jdiv (- n 1))}})
+(same-jit "jit division by zero" {jdiv 100})
+(fun {jloop k} {do (= {s} 0) (dotimes {i} k {= {s} (+ s (* i i))}) s})
+(same-jit "jit dotimes" {jloop 1000})
+(fun {jwhile k} {do (= {s} 0) (= {i} 0) (while {< i k} {do (= {s} (+ s i)) (= {i} (+ i 1))}) s})
+(same-jit "jit while" {jwhile 1000})
+(if has-jit {expect "jit compiles hot code" (try {> (jit-dump jsum "/dev/null") 0} {err}) 1} {})
+(jit jit-was)